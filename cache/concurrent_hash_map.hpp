@@ -0,0 +1,245 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "epoch.hpp"
+#include "key_hash.hpp"
+
+// Lock-free hash map from string keys to Value, meant as the key index of
+// a cache whose capacity is known up front: the bucket array is sized once
+// (a power of two >= expected_size) and never resized, so every operation
+// touches a single bucket.
+// Each bucket is a Harris-Michael list sorted by (hash, key). Removal first
+// marks the node's next pointer (logical delete), then unlinks it; any
+// writer walking past a marked node helps unlinking it. Values live in
+// their own immutable boxes so an assignment is one pointer exchange.
+// Nodes and values are allocated through an EpochManager, links are read
+// through its guard and unlinked nodes and replaced values are retired to
+// it, so a reader never touches freed memory.
+// - find()/contains()/visit(): lock-free, a pass over one bucket that
+//   never writes shared memory. It restarts if it runs into a node being
+//   removed: that node's successor may be freed already (its reservation
+//   only covers nodes reached through links that were live when read)
+// - insert()/insert_or_assign()/erase(): lock-free, CAS retry loops
+template <typename Value>
+class ConcurrentHashMap {
+   private:
+	struct ValueBox : Reclaimable {
+		const Value value;
+		explicit ValueBox(Value value) : value(std::move(value)) {}
+	};
+
+	struct Node : Reclaimable {
+		const uint64_t hash;
+		const std::string key;
+		std::atomic<const ValueBox*> value;
+		// low bit set: this node is logically deleted
+		std::atomic<uintptr_t> next{0};
+
+		Node(uint64_t hash, std::string key, const ValueBox* value)
+			: hash(hash), key(std::move(key)), value(value) {}
+		~Node() override { delete value.load(std::memory_order_relaxed); }
+	};
+	using Guard = EpochManager::Guard;
+
+	static constexpr uintptr_t kMarked = 1;
+	static Node* node_of(uintptr_t link) {
+		return reinterpret_cast<Node*>(link & ~kMarked);
+	}
+	static bool is_marked(uintptr_t link) { return link & kMarked; }
+	static uintptr_t link_of(const Node* node) {
+		return reinterpret_cast<uintptr_t>(node);
+	}
+
+	// (hash, key) ordering of a bucket list
+	static bool before(const Node* node, uint64_t hash,
+					   const std::string& key) {
+		return node->hash < hash || (node->hash == hash && node->key < key);
+	}
+
+	// bucket heads are cache line sized to keep CASes on neighbours apart
+	struct alignas(64) Bucket {
+		std::atomic<uintptr_t> head{0};
+	};
+
+	std::unique_ptr<Bucket[]> m_buckets;
+	const uint64_t m_bucket_mask;
+	std::atomic<size_t> m_size{0};
+	mutable EpochManager m_epochs;
+
+	// all bits of key_hash() are mixed, the bucket index uses the low ones
+	static uint64_t hash_of(const std::string& key) { return key_hash(key); }
+
+	// smallest power of two >= expected_size
+	static size_t bucket_count_for(size_t expected_size) {
+		if (expected_size <= 1) return 1;
+		return size_t(1) << (64 - __builtin_clzll(expected_size - 1));
+	}
+
+	Bucket& bucket_of(uint64_t hash) const {
+		return m_buckets[hash & m_bucket_mask];
+	}
+
+	// Finds the first node not ordered before (hash, key), unlinking marked
+	// nodes on the way. On return *prev is the link pointing to *cur (cur
+	// may be null). Returns true if *cur holds the key.
+	bool locate(Guard& guard, uint64_t hash, const std::string& key,
+				std::atomic<uintptr_t>*& prev, Node*& cur) {
+	retry:
+		prev = &bucket_of(hash).head;
+		cur = node_of(guard.protect(*prev));
+		while (cur) {
+			uintptr_t next = guard.protect(cur->next);
+			if (is_marked(next)) {
+				uintptr_t expected = link_of(cur);
+				if (!prev->compare_exchange_strong(expected,
+												   next & ~kMarked)) {
+					goto retry;
+				}
+				m_epochs.retire(cur);
+				cur = node_of(next);
+				continue;
+			}
+			if (!before(cur, hash, key)) {
+				return cur->hash == hash && cur->key == key;
+			}
+			prev = &cur->next;
+			cur = node_of(next);
+		}
+		return false;
+	}
+
+	// read only lookup: no helping, restarts past removed nodes
+	const Node* find_node(Guard& guard, uint64_t hash,
+						  const std::string& key) const {
+	retry:
+		const Node* cur = node_of(guard.protect(bucket_of(hash).head));
+		while (cur && before(cur, hash, key)) {
+			uintptr_t next = guard.protect(cur->next);
+			if (is_marked(next)) goto retry;
+			cur = node_of(next);
+		}
+		if (!cur || cur->hash != hash || cur->key != key) return nullptr;
+		if (is_marked(cur->next.load(std::memory_order_acquire))) {
+			return nullptr;
+		}
+		return cur;
+	}
+
+	// inserts, or assigns if `assign` and the key exists. Returns true if a
+	// new key was inserted
+	bool put(const std::string& key, Value value, bool assign) {
+		uint64_t hash = hash_of(key);
+		auto guard = m_epochs.pin();
+		const ValueBox* boxed = m_epochs.make<ValueBox>(std::move(value));
+		Node* node = nullptr;
+		std::atomic<uintptr_t>* prev;
+		Node* cur;
+		while (true) {
+			if (locate(guard, hash, key, prev, cur)) {
+				if (node) {
+					// never published, take the value box back
+					node->value.store(nullptr, std::memory_order_relaxed);
+					delete node;
+				}
+				if (assign) {
+					m_epochs.retire(cur->value.exchange(boxed));
+				} else {
+					delete boxed;
+				}
+				return false;
+			}
+			if (!node) node = m_epochs.make<Node>(hash, key, boxed);
+			node->next.store(link_of(cur), std::memory_order_relaxed);
+			uintptr_t expected = link_of(cur);
+			if (prev->compare_exchange_strong(expected, link_of(node))) {
+				m_size.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+	}
+
+   public:
+	explicit ConcurrentHashMap(size_t expected_size)
+		: m_buckets(new Bucket[bucket_count_for(expected_size)]),
+		  m_bucket_mask(bucket_count_for(expected_size) - 1) {}
+	ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+	ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+	// no other thread may use the map anymore
+	~ConcurrentHashMap() {
+		for (uint64_t i = 0; i <= m_bucket_mask; ++i) {
+			Node* cur = node_of(m_buckets[i].head.load());
+			while (cur) {
+				Node* next = node_of(cur->next.load());
+				delete cur;
+				cur = next;
+			}
+		}
+	}
+
+	// calls f(const Value&) if the key is present, the reference is valid
+	// only during the call. Returns true if it was present
+	template <typename F>
+	bool visit(const std::string& key, F&& f) const {
+		auto guard = m_epochs.pin();
+		const Node* node = find_node(guard, hash_of(key), key);
+		if (!node) return false;
+		f(guard.protect(node->value)->value);
+		return true;
+	}
+
+	// copies the value of `key` to `out`, returns false if absent
+	bool find(const std::string& key, Value& out) const {
+		return visit(key, [&out](const Value& value) { out = value; });
+	}
+
+	bool contains(const std::string& key) const {
+		auto guard = m_epochs.pin();
+		return find_node(guard, hash_of(key), key) != nullptr;
+	}
+
+	// inserts if absent, returns false (and leaves the map unchanged) if the
+	// key is already present
+	bool insert(const std::string& key, Value value) {
+		return put(key, std::move(value), false);
+	}
+
+	// inserts or replaces, returns true if the key was new
+	bool insert_or_assign(const std::string& key, Value value) {
+		return put(key, std::move(value), true);
+	}
+
+	// returns false if the key was absent
+	bool erase(const std::string& key) {
+		uint64_t hash = hash_of(key);
+		auto guard = m_epochs.pin();
+		std::atomic<uintptr_t>* prev;
+		Node* cur;
+		while (true) {
+			if (!locate(guard, hash, key, prev, cur)) return false;
+			uintptr_t next = cur->next.load(std::memory_order_acquire);
+			if (is_marked(next)) continue;
+			// the marking CAS is the linearization point, whoever marks
+			// first owns the removal
+			if (!cur->next.compare_exchange_strong(next, next | kMarked)) {
+				continue;
+			}
+			m_size.fetch_sub(1, std::memory_order_relaxed);
+			uintptr_t expected = link_of(cur);
+			if (prev->compare_exchange_strong(expected, next)) {
+				m_epochs.retire(cur);
+			} else {
+				// someone changed the predecessor, let a traversal unlink it
+				locate(guard, hash, key, prev, cur);
+			}
+			return true;
+		}
+	}
+
+	// approximate while writers are active
+	size_t size() const { return m_size.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,2969 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <poll.h>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "key_hash.hpp"
+#include "lock_profiler.hpp"
+#include "metrics.hpp"
+
+// Abstract structure for a database interface
+struct i_db {
+	virtual bool begin_transaction() = 0;
+	virtual bool commit_transaction() = 0;
+	virtual bool abort_transaction() = 0;
+	virtual std::string get_key(const std::string& key) = 0;
+	virtual std::string set_key(const std::string& key,
+								const std::string& data) = 0;
+	virtual std::string delete_key(const std::string& key) = 0;
+};
+
+// little-endian fixed width integer (de)serialization helpers for binary files
+inline void binary_write_u32(std::ostream& out, uint32_t value) {
+	char bytes[4];
+	for (int i = 0; i < 4; ++i) bytes[i] = static_cast<char>(value >> (8 * i));
+	out.write(bytes, sizeof(bytes));
+}
+inline void binary_write_u64(std::ostream& out, uint64_t value) {
+	char bytes[8];
+	for (int i = 0; i < 8; ++i) bytes[i] = static_cast<char>(value >> (8 * i));
+	out.write(bytes, sizeof(bytes));
+}
+inline bool binary_read_u32(std::istream& in, uint32_t& value) {
+	unsigned char bytes[4];
+	if (!in.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) return false;
+	value = 0;
+	for (int i = 0; i < 4; ++i) {
+		value |= static_cast<uint32_t>(bytes[i]) << (8 * i);
+	}
+	return true;
+}
+inline bool binary_read_u64(std::istream& in, uint64_t& value) {
+	unsigned char bytes[8];
+	if (!in.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) return false;
+	value = 0;
+	for (int i = 0; i < 8; ++i) {
+		value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+	}
+	return true;
+}
+
+// LEB128 varint: 7 bits per byte, high bit set on all but the last byte
+inline void varint_append(std::string& out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+// returns false if varint is truncated or too long
+inline bool varint_parse(const char*& pos, const char* end, uint64_t& value) {
+	value = 0;
+	for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+		uint8_t byte = static_cast<uint8_t>(*pos++);
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+// LZ77 compression of cached values, LZ4-like: greedy matching of 4+ byte
+// sequences found through a 4096 entry hash table of recent positions.
+// Format: varint raw size, then sequences of varint literal count, literals,
+// varint match length (0 - end of data) and varint match offset back from
+// the current output end
+inline std::string lz_compress(std::string_view in) {
+	constexpr size_t kMinMatch = 4;
+	constexpr int kHashBits = 12;
+	// positions + 1 of the last 4 byte sequence with each hash, 0 - none
+	std::array<uint32_t, 1 << kHashBits> table{};
+	auto read32 = [&in](size_t pos) {
+		uint32_t value;
+		std::memcpy(&value, in.data() + pos, sizeof(value));
+		return value;
+	};
+	std::string out;
+	out.reserve(in.size() / 2 + 16);
+	varint_append(out, in.size());
+	size_t anchor{0}, pos{0};
+	while (pos + kMinMatch <= in.size()) {
+		uint32_t sequence = read32(pos);
+		uint32_t& slot = table[(sequence * 2654435761U) >> (32 - kHashBits)];
+		size_t candidate = slot;
+		slot = static_cast<uint32_t>(pos + 1);
+		if (candidate == 0 || read32(candidate - 1) != sequence) {
+			++pos;
+			continue;
+		}
+		--candidate;
+		size_t length = kMinMatch;
+		while (pos + length < in.size() &&
+			   in[candidate + length] == in[pos + length]) {
+			++length;
+		}
+		varint_append(out, pos - anchor);
+		out.append(in.substr(anchor, pos - anchor));
+		varint_append(out, length);
+		varint_append(out, pos - candidate);
+		pos += length;
+		anchor = pos;
+	}
+	varint_append(out, in.size() - anchor);
+	out.append(in.substr(anchor));
+	varint_append(out, 0);
+	return out;
+}
+
+// decompresses lz_compress() output to `out`
+// returns false if `in` is malformed
+inline bool lz_decompress(std::string_view in, std::string& out) {
+	const char* pos = in.data();
+	const char* end = pos + in.size();
+	uint64_t size{};
+	if (!varint_parse(pos, end, size)) return false;
+	out.clear();
+	// not trusting a corrupted size with the allocation
+	out.reserve(std::min<uint64_t>(size, 64 * in.size()));
+	while (true) {
+		uint64_t literals{}, length{}, offset{};
+		if (!varint_parse(pos, end, literals) ||
+			static_cast<uint64_t>(end - pos) < literals ||
+			out.size() + literals > size) {
+			return false;
+		}
+		out.append(pos, literals);
+		pos += literals;
+		if (!varint_parse(pos, end, length)) return false;
+		if (length == 0) break;
+		if (!varint_parse(pos, end, offset) || offset == 0 ||
+			offset > out.size() || out.size() + length > size) {
+			return false;
+		}
+		// byte by byte, a match may overlap the bytes it produces
+		size_t from = out.size() - offset;
+		size_t at = out.size();
+		out.resize(at + length);
+		for (size_t i = 0; i < length; ++i) out[at + i] = out[from + i];
+	}
+	return out.size() == size && pos == end;
+}
+
+// writes `contents` to a temporary file, fsyncs it and renames it over
+// `path`, so readers never see a half written file and a crash leaves
+// either the old or the new one
+// returns false on file errors
+inline bool write_file_atomically(const std::string& path,
+								  const std::string& contents) {
+	// unique per writer, several may rewrite one path at once
+	static std::atomic<uint64_t> s_next_tmp{0};
+	std::string tmp_path = path + ".tmp." + std::to_string(::getpid()) + "." +
+						   std::to_string(s_next_tmp.fetch_add(1));
+	int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		std::cerr << "Error opening " << tmp_path << " for writing!\n";
+		return false;
+	}
+	size_t done{0};
+	while (done < contents.size()) {
+		ssize_t n = ::write(fd, contents.data() + done, contents.size() - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+	bool written = done == contents.size() && ::fsync(fd) == 0;
+	::close(fd);
+	if (!written) {
+		std::cerr << "Error writing " << tmp_path << "!\n";
+		::unlink(tmp_path.c_str());
+		return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmp_path, path, ec);
+	if (ec) {
+		std::cerr << "Error renaming " << tmp_path << ": " << ec.message()
+				  << "\n";
+		return false;
+	}
+	return true;
+}
+
+// runs a task on a background thread every `interval` until stopped or
+// destroyed. the task is not run on shutdown, owners do their final work
+// themselves after stop()
+class PeriodicTask {
+   private:
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop{false};
+	// declared last so it starts after the members it uses are initialized
+	std::thread m_thread;
+
+   public:
+	PeriodicTask(std::chrono::milliseconds interval, std::function<void()> task)
+		: m_thread([this, interval, task = std::move(task)]() {
+			  std::unique_lock<std::mutex> lock(m_mutex);
+			  while (!m_cv.wait_for(lock, interval,
+									[this] { return m_stop; })) {
+				  lock.unlock();
+				  task();
+				  lock.lock();
+			  }
+		  }) {}
+	PeriodicTask(const PeriodicTask&) = delete;
+	PeriodicTask& operator=(const PeriodicTask&) = delete;
+	~PeriodicTask() { stop(); }
+
+	// wakes the background thread and waits for it to finish
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		if (m_thread.joinable()) m_thread.join();
+	}
+};
+
+// runs submitted tasks on a fixed number of background threads, in
+// submission order. tasks still queued when stopped are run first
+class WorkerPool {
+   private:
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_stop{false};
+	// declared last so they start after the members they use are initialized
+	std::vector<std::thread> m_threads;
+
+	void run() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true) {
+			m_cv.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+			if (m_tasks.empty()) return;  // stopped
+			std::function<void()> task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+
+   public:
+	explicit WorkerPool(size_t threads) {
+		for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+			m_threads.emplace_back([this] { run(); });
+		}
+	}
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	~WorkerPool() { stop(); }
+
+	void submit(std::function<void()> task) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back(std::move(task));
+		}
+		m_cv.notify_one();
+	}
+
+	// runs the queued tasks and waits for the threads to finish
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		for (std::thread& thread : m_threads) {
+			if (thread.joinable()) thread.join();
+		}
+	}
+};
+
+// Abstract structure for the cache of a database: key -> value pairs, where
+// std::nullopt value caches a deletion. Keys come with their hash (see
+// HashedKey), implementations use it instead of hashing them again.
+// Implementations need not be thread-safe, the database serialises access.
+// save(), load() and print_self() work on any implementation through
+// capacity() and for_each()
+struct i_cache {
+	virtual ~i_cache() = default;
+	virtual void put(const HashedKey& key,
+					 const std::optional<std::string>& value) = 0;
+	virtual bool get(const HashedKey& key,
+					 std::optional<std::string>& value) = 0;
+	// forgets the key (unlike putting std::nullopt, which caches a deletion)
+	virtual void erase(const HashedKey& key) = 0;
+	virtual void clear() = 0;
+	virtual size_t capacity() const = 0;
+	virtual size_t size() const = 0;
+	virtual size_t evictions() const = 0;
+	virtual size_t hits() const = 0;
+	// only Cache compresses values
+	virtual CacheCompressionStats compression_stats() const { return {}; }
+	// hits in / size of the second (disk) tier, only TieredCache has one
+	virtual size_t second_tier_hits() const { return 0; }
+	virtual size_t second_tier_size() const { return 0; }
+	// calls f(key, value) for every pair from front (most recent) to back
+	virtual void for_each(
+		const std::function<void(const std::string&,
+								 const std::optional<std::string>&)>& f)
+		const = 0;
+
+	// Serializes cache contents from front (most recent) to back:
+	// u64 entry count, then per entry u8 has_value, u32 key length, key and
+	// (if has_value) u32 value length, value
+	void save(std::ostream& out) const {
+		binary_write_u64(out, size());
+		for_each([&out](const std::string& key,
+						const std::optional<std::string>& value_opt) {
+			out.put(value_opt.has_value() ? 1 : 0);
+			binary_write_u32(out, static_cast<uint32_t>(key.size()));
+			out.write(key.data(), key.size());
+			if (value_opt.has_value()) {
+				binary_write_u32(out, static_cast<uint32_t>(value_opt->size()));
+				out.write(value_opt->data(), value_opt->size());
+			}
+		});
+	}
+
+	// Restores contents written by save() keeping their LRU order. Entries
+	// beyond capacity (least recent ones) are dropped.
+	// returns false and leaves cache untouched if the data is malformed
+	bool load(std::istream& in) {
+		uint64_t count{};
+		if (!binary_read_u64(in, count)) return false;
+		std::vector<std::pair<std::string, std::optional<std::string>>> entries;
+		for (uint64_t i = 0; i < count; ++i) {
+			char has_value{};
+			uint32_t size{};
+			if (!in.get(has_value) || !binary_read_u32(in, size)) return false;
+			std::string key(size, '\0');
+			if (!in.read(key.data(), size)) return false;
+			std::optional<std::string> value;
+			if (has_value) {
+				if (!binary_read_u32(in, size)) return false;
+				value.emplace(size, '\0');
+				if (!in.read(value->data(), size)) return false;
+			}
+			// no need to keep what would be evicted right away
+			if (entries.size() < capacity()) {
+				entries.emplace_back(std::move(key), std::move(value));
+			}
+		}
+		// putting least recent first so the most recent ends up at the front
+		for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+			put(it->first, it->second);
+		}
+		return true;
+	}
+
+	// Prints cache capacity and the cache contents from front to back
+	void print_self() const {
+		std::cout << "cache capacity - " << capacity()
+				  << " key-value pairs\r\n";
+		for_each([](const std::string& key,
+					const std::optional<std::string>& value_opt) {
+			std::cout << key << ": ";
+			if (value_opt.has_value()) {
+				std::cout << value_opt.value();
+			} else {
+				std::cout << "<deleted>";
+			}
+			std::cout << "\r\n";
+		});
+	}
+};
+
+// recently used cache for key-value pairs.
+// contains list of key-value pairs and a hashmap of keys to iterators
+// (pointers) to list elements, for O(1) access. No iterators are invalidated in
+// the process.
+// when get() or put() gets called moves accessed key to the front of the cache.
+// caches delete calls using put() with std::nullopt for value parameter.
+// values can be kept compressed (see set_compression())
+struct Cache : i_cache {
+   private:
+	struct Entry {
+		HashedKey key;
+		// if optional is std::nullopt the key-value pair is deleted
+		std::optional<std::string> value;
+		// value holds lz_compress() output
+		bool compressed{false};
+	};
+	// max size of key-value pairs to cache
+	size_t m_capacity;
+	// actual cache as a list
+	std::list<Entry> m_cache;
+	// map<key, pointer(iterator) to list element> for fast access
+	std::unordered_map<HashedKey, std::list<Entry>::iterator, HashedKeyHash>
+		m_cache_map;
+	// number of pairs pushed out of the cache / found by get() so far
+	size_t m_evictions{0};
+	size_t m_hits{0};
+	// values at least this long are compressed, 0 - compression is off
+	size_t m_compress_min_size{0};
+	CacheCompressionStats m_compression;
+	// called with pairs pushed out of the cache
+	std::function<void(const HashedKey&, const std::optional<std::string>&)>
+		m_eviction_listener;
+
+	static uint64_t ns_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now() - start)
+			.count();
+	}
+
+	// sets value of `entry`, compressed if compression is on, the value is
+	// long enough and shrinks to at most 7/8 of its size (JSON and other
+	// text usually shrinks 3-5x, random bytes not at all)
+	void store(Entry& entry, const std::optional<std::string>& value) {
+		forget(entry);
+		entry.compressed = false;
+		entry.value = value;
+		if (!value) return;
+		m_compression.raw_bytes += value->size();
+		if (m_compress_min_size && value->size() >= m_compress_min_size) {
+			auto start = std::chrono::steady_clock::now();
+			std::string compressed = lz_compress(*value);
+			++m_compression.compressions;
+			m_compression.compress_ns += ns_since(start);
+			if (compressed.size() <= value->size() / 8 * 7) {
+				entry.value = std::move(compressed);
+				entry.compressed = true;
+				++m_compression.compressed_values;
+			}
+		}
+		m_compression.stored_bytes += entry.value->size();
+	}
+
+	// removes value of `entry` from the byte counts
+	void forget(const Entry& entry) {
+		if (!entry.value) return;
+		m_compression.stored_bytes -= entry.value->size();
+		if (!entry.compressed) {
+			m_compression.raw_bytes -= entry.value->size();
+			return;
+		}
+		const char* pos = entry.value->data();
+		uint64_t raw_size{0};
+		varint_parse(pos, pos + entry.value->size(), raw_size);
+		m_compression.raw_bytes -= raw_size;
+		--m_compression.compressed_values;
+	}
+
+	// value of `entry` as it was put
+	std::optional<std::string> stored_value(const Entry& entry) const {
+		if (!entry.compressed) return entry.value;
+		std::string value;
+		lz_decompress(*entry.value, value);
+		return value;
+	}
+
+	// moves key-value pair in a list to front of the cache in O(1)
+	void move_to_front(std::list<Entry>::iterator it) {
+		m_cache.splice(m_cache.begin(), m_cache, it);
+	}
+
+   public:
+	Cache(size_t capacity) : m_capacity(capacity) {}
+
+	// Puts a pair to the cache (you can also put deletion with std::nullopt)
+	// if pair is already in cache - moves it to the front
+	// else pushes this new key-value pair to the front of the cache
+	// if buffer full - removes 1 item at back of cache
+	void put(const HashedKey& key,
+			 const std::optional<std::string>& value) override {
+		auto found = m_cache_map.find(key);
+		if (found != m_cache_map.end()) {
+			// key is found in a map
+			store(*found->second, value);
+			move_to_front(found->second);
+			return;
+		}
+
+		if (m_cache.size() >= m_capacity) {
+			// key is not in map and the capacity is used up
+			if (m_eviction_listener) {
+				const Entry& last = m_cache.back();
+				m_eviction_listener(last.key, stored_value(last));
+			}
+			forget(m_cache.back());
+			m_cache_map.erase(m_cache.back().key);
+			m_cache.pop_back();
+			++m_evictions;
+		}
+
+		// key is not in a map so we add it to the front
+		m_cache.push_front(Entry{key, std::nullopt, false});
+		store(m_cache.front(), value);
+		m_cache_map.emplace(key, m_cache.begin());
+	}
+
+	// Gets value item from the cache given key
+	// if there's no key in cache - returns false
+	// else returns true, returns actual std::optional<std::string> value
+	// through value parameter if it exists in cache and moves key-value pair to
+	// the front of cache
+	bool get(const HashedKey& key,
+			 std::optional<std::string>& value) override {
+		auto it = m_cache_map.find(key);
+		if (it == m_cache_map.end()) return false;
+
+		if (it->second->compressed) {
+			// decompressed on every hit, the cache keeps the small copy
+			auto start = std::chrono::steady_clock::now();
+			value = stored_value(*it->second);
+			++m_compression.decompressions;
+			m_compression.decompress_ns += ns_since(start);
+		} else {
+			value = it->second->value;
+		}
+		++m_hits;
+		// recently used, so we put to the front of the cache
+		move_to_front(it->second);
+		return true;
+	}
+
+	void erase(const HashedKey& key) override {
+		auto it = m_cache_map.find(key);
+		if (it == m_cache_map.end()) return;
+		forget(*it->second);
+		m_cache.erase(it->second);
+		m_cache_map.erase(it);
+	}
+
+	void clear() override {
+		m_cache.clear();
+		m_cache_map.clear();
+		m_compression.raw_bytes = m_compression.stored_bytes = 0;
+		m_compression.compressed_values = 0;
+	}
+
+	// Keeps values of at least `min_size` bytes (0 - none) put from now on
+	// compressed, trading CPU on every put and hit for fitting more values
+	// in the same memory
+	void set_compression(size_t min_size) { m_compress_min_size = min_size; }
+
+	// Sets function called with every pair pushed out of the cache (not
+	// with ones removed by clear())
+	void set_eviction_listener(
+		std::function<void(const HashedKey&,
+						   const std::optional<std::string>&)>
+			listener) {
+		m_eviction_listener = std::move(listener);
+	}
+
+	size_t capacity() const override { return m_capacity; }
+	size_t size() const override { return m_cache.size(); }
+	size_t evictions() const override { return m_evictions; }
+	size_t hits() const override { return m_hits; }
+	CacheCompressionStats compression_stats() const override {
+		return m_compression;
+	}
+
+	void for_each(
+		const std::function<void(const std::string&,
+								 const std::optional<std::string>&)>& f)
+		const override {
+		for (const Entry& entry : m_cache) {
+			f(entry.key.key, stored_value(entry));
+		}
+	}
+};
+
+// Cache living in a POSIX shared memory segment, so processes of a host
+// that run their own CachedFileDatabase over the same file share one hot
+// set instead of each one warming its own copy.
+// The segment is a fixed-size arena: a header, a hash table of bucket heads
+// and `capacity` fixed-size slots holding up to `entry_bytes` of key and
+// value each (bigger pairs are not cached). Every process maps it at a
+// different address, so slots refer to each other by index (an offset into
+// the segment), never by pointer. All access takes a process-shared robust
+// mutex: if a process dies holding it, the next one to lock it finds the
+// slots possibly half updated and clears the cache.
+// The segment outlives the processes until remove(). It remembers the DB
+// file fingerprint after the last write through it (source_matches(),
+// set_source()), so a database attaching to a segment whose file was changed
+// behind its back can clear it.
+class SharedMemoryCache : public i_cache {
+   private:
+	// version 2: slots hash keys with key_hash()
+	static constexpr uint64_t kMagic = 0x3243'4D48'5342'4400;  // "\0DBSHMC2"
+	static constexpr uint32_t kNil = UINT32_MAX;
+	// how long attach waits for the creator to initialize the segment
+	static constexpr int kAttachWaitMs = 1000;
+
+	struct Header {
+		uint64_t magic;
+		uint64_t segment_size;
+		uint32_t capacity;
+		uint32_t bucket_count;
+		uint32_t entry_bytes;
+		uint32_t slot_stride;
+		// set by the creator once everything below is initialized
+		std::atomic<uint32_t> ready;
+		pthread_mutex_t mutex;
+		// guarded by mutex
+		uint32_t lru_head;	// most recently used slot
+		uint32_t lru_tail;
+		uint32_t free_head;	 // free slots, linked through lru_next
+		uint64_t size;
+		uint64_t hits;
+		uint64_t evictions;
+		uint64_t source_size;
+		uint64_t source_mtime;
+	};
+	// slot header, followed by key bytes then value bytes
+	struct Slot {
+		uint64_t hash;
+		uint32_t chain_next;
+		uint32_t lru_prev;
+		uint32_t lru_next;
+		uint32_t key_size;
+		uint32_t value_size;
+		uint32_t has_value;
+	};
+
+	static constexpr size_t kBucketsOffset = (sizeof(Header) + 63) / 64 * 64;
+	static size_t slots_offset(size_t bucket_count) {
+		return (kBucketsOffset + bucket_count * sizeof(uint32_t) + 63) / 64 *
+			   64;
+	}
+
+	char* m_base;
+	size_t m_mapped_size;
+	Header* m_header;
+
+	SharedMemoryCache(char* base, size_t mapped_size)
+		: m_base(base),
+		  m_mapped_size(mapped_size),
+		  m_header(reinterpret_cast<Header*>(base)) {}
+
+	uint32_t* buckets() const {
+		return reinterpret_cast<uint32_t*>(m_base + kBucketsOffset);
+	}
+	Slot* slot(uint32_t index) const {
+		return reinterpret_cast<Slot*>(
+			m_base + slots_offset(m_header->bucket_count) +
+			static_cast<size_t>(index) * m_header->slot_stride);
+	}
+	static char* slot_data(Slot* s) { return reinterpret_cast<char*>(s + 1); }
+
+	// robust lock of the segment, clears the cache if its owner died
+	class Lock {
+	   private:
+		SharedMemoryCache& m_cache;
+
+	   public:
+		explicit Lock(const SharedMemoryCache& cache)
+			: m_cache(const_cast<SharedMemoryCache&>(cache)) {
+			if (pthread_mutex_lock(&m_cache.m_header->mutex) == EOWNERDEAD) {
+				std::cerr << "Shared cache: a process died holding the lock, "
+							 "clearing the cache\n";
+				m_cache.reset();
+				pthread_mutex_consistent(&m_cache.m_header->mutex);
+			}
+		}
+		Lock(const Lock&) = delete;
+		Lock& operator=(const Lock&) = delete;
+		~Lock() { pthread_mutex_unlock(&m_cache.m_header->mutex); }
+	};
+
+	// empties the cache, all slots go to the free list. call under Lock
+	void reset() {
+		Header& h = *m_header;
+		std::fill(buckets(), buckets() + h.bucket_count, kNil);
+		for (uint32_t i = 0; i < h.capacity; ++i) {
+			slot(i)->lru_next = i + 1 < h.capacity ? i + 1 : kNil;
+		}
+		h.free_head = 0;
+		h.lru_head = h.lru_tail = kNil;
+		h.size = 0;
+	}
+
+	// first-time setup by the process that created the segment
+	void init(uint32_t capacity, uint32_t entry_bytes, size_t segment_size) {
+		Header& h = *new (m_base) Header{};
+		h.magic = kMagic;
+		h.segment_size = segment_size;
+		h.capacity = capacity;
+		h.bucket_count = capacity;
+		h.entry_bytes = entry_bytes;
+		h.slot_stride = static_cast<uint32_t>(
+			(sizeof(Slot) + entry_bytes + 7) / 8 * 8);
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		pthread_mutex_init(&h.mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+		reset();
+		h.ready.store(1, std::memory_order_release);
+	}
+
+	// slot holding `key`, or kNil. call under Lock
+	uint32_t find(const std::string& key, uint64_t hash) const {
+		uint32_t i = buckets()[hash % m_header->bucket_count];
+		while (i != kNil) {
+			Slot* s = slot(i);
+			if (s->hash == hash && s->key_size == key.size() &&
+				std::equal(key.begin(), key.end(), slot_data(s))) {
+				return i;
+			}
+			i = s->chain_next;
+		}
+		return kNil;
+	}
+
+	void lru_unlink(uint32_t i) {
+		Slot* s = slot(i);
+		if (s->lru_prev != kNil) {
+			slot(s->lru_prev)->lru_next = s->lru_next;
+		} else {
+			m_header->lru_head = s->lru_next;
+		}
+		if (s->lru_next != kNil) {
+			slot(s->lru_next)->lru_prev = s->lru_prev;
+		} else {
+			m_header->lru_tail = s->lru_prev;
+		}
+	}
+	void lru_push_front(uint32_t i) {
+		Slot* s = slot(i);
+		s->lru_prev = kNil;
+		s->lru_next = m_header->lru_head;
+		if (m_header->lru_head != kNil) {
+			slot(m_header->lru_head)->lru_prev = i;
+		} else {
+			m_header->lru_tail = i;
+		}
+		m_header->lru_head = i;
+	}
+
+	// unlinks slot `i` from its bucket and the LRU list and frees it
+	void remove_slot(uint32_t i) {
+		Slot* s = slot(i);
+		uint32_t* link = &buckets()[s->hash % m_header->bucket_count];
+		while (*link != i) link = &slot(*link)->chain_next;
+		*link = s->chain_next;
+		lru_unlink(i);
+		s->lru_next = m_header->free_head;
+		m_header->free_head = i;
+		--m_header->size;
+	}
+
+   public:
+	// Creates segment `name` (e.g. "/db_cache") or attaches to an existing
+	// one, in which case its own capacity and entry size are used.
+	// returns nullptr (after printing why) on errors
+	static std::unique_ptr<SharedMemoryCache> open(const std::string& name,
+												   size_t capacity,
+												   size_t entry_bytes) {
+		if (capacity == 0 || capacity >= kNil || entry_bytes >= kNil) {
+			std::cerr << "Shared cache: bad capacity or entry size!\n";
+			return nullptr;
+		}
+		int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		bool creator = fd >= 0;
+		if (!creator && errno == EEXIST) {
+			fd = shm_open(name.c_str(), O_RDWR, 0600);
+		}
+		if (fd < 0) {
+			std::cerr << "Error opening shared memory " << name << "!\n";
+			return nullptr;
+		}
+
+		size_t size{0};
+		if (creator) {
+			size_t stride = (sizeof(Slot) + entry_bytes + 7) / 8 * 8;
+			size = slots_offset(capacity) + capacity * stride;
+			if (ftruncate(fd, size) != 0) {
+				std::cerr << "Error sizing shared memory " << name << "!\n";
+				::close(fd);
+				shm_unlink(name.c_str());
+				return nullptr;
+			}
+		} else {
+			// the creator may not have sized it yet
+			struct stat st {};
+			for (int ms = 0; ms < kAttachWaitMs; ++ms) {
+				if (fstat(fd, &st) == 0 && st.st_size > 0) break;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			size = static_cast<size_t>(st.st_size);
+		}
+		void* base = size < sizeof(Header)
+						 ? MAP_FAILED
+						 : mmap(nullptr, size, PROT_READ | PROT_WRITE,
+								MAP_SHARED, fd, 0);
+		::close(fd);
+		if (base == MAP_FAILED) {
+			std::cerr << "Error mapping shared memory " << name << "!\n";
+			if (creator) shm_unlink(name.c_str());
+			return nullptr;
+		}
+
+		std::unique_ptr<SharedMemoryCache> cache(
+			new SharedMemoryCache(static_cast<char*>(base), size));
+		if (creator) {
+			cache->init(static_cast<uint32_t>(capacity),
+						static_cast<uint32_t>(entry_bytes), size);
+			return cache;
+		}
+		Header& h = *cache->m_header;
+		for (int ms = 0; ms < kAttachWaitMs; ++ms) {
+			if (h.ready.load(std::memory_order_acquire)) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (!h.ready.load(std::memory_order_acquire) || h.magic != kMagic ||
+			h.segment_size != size) {
+			std::cerr << "Shared memory " << name
+					  << " is not a cache or its creator died while setting "
+						 "it up, remove() it\n";
+			return nullptr;
+		}
+		return cache;
+	}
+
+	// unlinks segment `name`, processes that have it mapped keep using it
+	static bool remove(const std::string& name) {
+		return shm_unlink(name.c_str()) == 0;
+	}
+
+	SharedMemoryCache(const SharedMemoryCache&) = delete;
+	SharedMemoryCache& operator=(const SharedMemoryCache&) = delete;
+	~SharedMemoryCache() override { munmap(m_base, m_mapped_size); }
+
+	// Puts a pair to the front of the cache, evicting the least recent one
+	// if all slots are taken. A pair too big for a slot is not cached (and
+	// an older value of the key is dropped)
+	void put(const HashedKey& hashed,
+			 const std::optional<std::string>& value) override {
+		const std::string& key = hashed.key;
+		uint64_t hash = hashed.hash;
+		size_t bytes = key.size() + (value ? value->size() : 0);
+		Lock lock(*this);
+		Header& h = *m_header;
+		uint32_t i = find(key, hash);
+		if (bytes > h.entry_bytes) {
+			if (i != kNil) remove_slot(i);
+			return;
+		}
+		if (i == kNil) {
+			if (h.free_head == kNil) {
+				remove_slot(h.lru_tail);
+				++h.evictions;
+			}
+			i = h.free_head;
+			Slot* s = slot(i);
+			h.free_head = s->lru_next;
+			s->hash = hash;
+			s->key_size = static_cast<uint32_t>(key.size());
+			std::copy(key.begin(), key.end(), slot_data(s));
+			uint32_t& bucket = buckets()[hash % h.bucket_count];
+			s->chain_next = bucket;
+			bucket = i;
+			++h.size;
+		} else {
+			lru_unlink(i);
+		}
+		Slot* s = slot(i);
+		s->has_value = value.has_value();
+		s->value_size = value ? static_cast<uint32_t>(value->size()) : 0;
+		if (value) {
+			std::copy(value->begin(), value->end(), slot_data(s) + s->key_size);
+		}
+		lru_push_front(i);
+	}
+
+	// returns true and the value (std::nullopt for a cached deletion) if the
+	// key is cached, moving it to the front
+	bool get(const HashedKey& key,
+			 std::optional<std::string>& value) override {
+		Lock lock(*this);
+		uint32_t i = find(key.key, key.hash);
+		if (i == kNil) return false;
+		Slot* s = slot(i);
+		if (s->has_value) {
+			value.emplace(slot_data(s) + s->key_size, s->value_size);
+		} else {
+			value = std::nullopt;
+		}
+		++m_header->hits;
+		lru_unlink(i);
+		lru_push_front(i);
+		return true;
+	}
+
+	// counters are of all processes using the segment
+	size_t capacity() const override { return m_header->capacity; }
+	size_t size() const override {
+		Lock lock(*this);
+		return m_header->size;
+	}
+	size_t evictions() const override {
+		Lock lock(*this);
+		return m_header->evictions;
+	}
+	size_t hits() const override {
+		Lock lock(*this);
+		return m_header->hits;
+	}
+
+	void for_each(
+		const std::function<void(const std::string&,
+								 const std::optional<std::string>&)>& f)
+		const override {
+		Lock lock(*this);
+		for (uint32_t i = m_header->lru_head; i != kNil;
+			 i = slot(i)->lru_next) {
+			Slot* s = slot(i);
+			std::string key(slot_data(s), s->key_size);
+			if (s->has_value) {
+				f(key, std::string(slot_data(s) + s->key_size, s->value_size));
+			} else {
+				f(key, std::nullopt);
+			}
+		}
+	}
+
+	void erase(const HashedKey& key) override {
+		Lock lock(*this);
+		uint32_t i = find(key.key, key.hash);
+		if (i != kNil) remove_slot(i);
+	}
+
+	void clear() override {
+		Lock lock(*this);
+		reset();
+	}
+
+	// whether the last write through the segment left the DB file with
+	// `fingerprint` (size, modification time)
+	bool source_matches(std::pair<uint64_t, uint64_t> fingerprint) const {
+		Lock lock(*this);
+		return m_header->source_size == fingerprint.first &&
+			   m_header->source_mtime == fingerprint.second;
+	}
+	void set_source(std::pair<uint64_t, uint64_t> fingerprint) {
+		Lock lock(*this);
+		m_header->source_size = fingerprint.first;
+		m_header->source_mtime = fingerprint.second;
+	}
+};
+
+// Second cache tier in a file on local disk, for values evicted from the
+// memory cache. Records (u32 key size, u32 value size, key, value) are
+// appended to a log that wraps around at `max_bytes`, writing over (and
+// dropping) the oldest records, so the tier keeps the most recently evicted
+// values. The in-memory index maps only a 64-bit key hash to a record
+// location, the key in the record tells hash collisions apart, so a hit is
+// a single pread(). Contents don't survive restarts (the file is truncated
+// on open and removed on destruction).
+// not thread-safe
+class DiskCache {
+   private:
+	static constexpr size_t kRecordHeaderSize = 2 * sizeof(uint32_t);
+
+	struct Location {
+		uint64_t offset;
+		uint32_t length;
+	};
+	// a record in the log, which may have been replaced in the index since
+	struct LogRecord {
+		uint64_t offset;
+		uint64_t hash;
+	};
+
+	int m_fd;
+	std::string m_path;
+	uint64_t m_max_bytes;
+	// where the next record is written
+	uint64_t m_head{0};
+	std::unordered_map<uint64_t, Location> m_index;
+	// records in write order, oldest first
+	std::deque<LogRecord> m_log;
+	size_t m_hits{0};
+
+	DiskCache(int fd, std::string path, uint64_t max_bytes)
+		: m_fd(fd), m_path(std::move(path)), m_max_bytes(max_bytes) {}
+
+	void drop_oldest() {
+		const LogRecord& record = m_log.front();
+		auto it = m_index.find(record.hash);
+		if (it != m_index.end() && it->second.offset == record.offset) {
+			m_index.erase(it);
+		}
+		m_log.pop_front();
+	}
+
+	// drops records a `length` byte record written at the head would
+	// overwrite, wrapping the head around if the file end is too close
+	void make_room(uint64_t length) {
+		if (m_head + length > m_max_bytes) {
+			// the oldest records, past the head, are lost with the file end
+			while (!m_log.empty() && m_log.front().offset >= m_head) {
+				drop_oldest();
+			}
+			m_head = 0;
+		}
+		while (!m_log.empty() && m_log.front().offset >= m_head &&
+			   m_log.front().offset < m_head + length) {
+			drop_oldest();
+		}
+	}
+
+   public:
+	// Creates (or truncates) cache file `path` of up to `max_bytes`
+	// returns nullptr (after printing why) on errors
+	static std::unique_ptr<DiskCache> open(const std::string& path,
+										   uint64_t max_bytes) {
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+						0600);
+		if (fd < 0) {
+			std::cerr << "Error opening disk cache " << path << "!\n";
+			return nullptr;
+		}
+		return std::unique_ptr<DiskCache>(new DiskCache(fd, path, max_bytes));
+	}
+
+	DiskCache(const DiskCache&) = delete;
+	DiskCache& operator=(const DiskCache&) = delete;
+	~DiskCache() {
+		::close(m_fd);
+		::unlink(m_path.c_str());
+	}
+
+	// writes a pair to the log, replacing an older value of the key. a pair
+	// too big for the file or failing to write is not cached
+	void put(const HashedKey& hashed, const std::string& value) {
+		erase(hashed);
+		const std::string& key = hashed.key;
+		uint64_t length = kRecordHeaderSize + key.size() + value.size();
+		if (length > m_max_bytes || length > UINT32_MAX) return;
+		std::string record;
+		record.reserve(length);
+		for (uint32_t size : {static_cast<uint32_t>(key.size()),
+							  static_cast<uint32_t>(value.size())}) {
+			for (int i = 0; i < 4; ++i) {
+				record.push_back(static_cast<char>(size >> (8 * i)));
+			}
+		}
+		record.append(key).append(value);
+		make_room(length);
+		if (::pwrite(m_fd, record.data(), record.size(), m_head) !=
+			static_cast<ssize_t>(record.size())) {
+			std::cerr << "Error writing disk cache!\n";
+			return;
+		}
+		m_index[hashed.hash] = Location{m_head, static_cast<uint32_t>(length)};
+		m_log.push_back(LogRecord{m_head, hashed.hash});
+		m_head += length;
+	}
+
+	// reads value of `key` with one pread()
+	// returns false if it isn't cached
+	bool get(const HashedKey& hashed, std::string& value) {
+		const std::string& key = hashed.key;
+		auto it = m_index.find(hashed.hash);
+		if (it == m_index.end()) return false;
+		std::string record(it->second.length, '\0');
+		if (::pread(m_fd, record.data(), record.size(), it->second.offset) !=
+			static_cast<ssize_t>(record.size())) {
+			std::cerr << "Error reading disk cache!\n";
+			return false;
+		}
+		uint32_t key_size{0};
+		for (int i = 0; i < 4; ++i) {
+			key_size |= static_cast<uint32_t>(static_cast<uint8_t>(record[i]))
+						<< (8 * i);
+		}
+		if (key_size != key.size() ||
+			record.compare(kRecordHeaderSize, key_size, key) != 0) {
+			return false;  // another key with the same hash
+		}
+		value.assign(record, kRecordHeaderSize + key_size);
+		++m_hits;
+		return true;
+	}
+
+	// forgets value of `key`, its record stays in the log until overwritten
+	void erase(const HashedKey& key) { m_index.erase(key.hash); }
+
+	void clear() {
+		m_index.clear();
+		m_log.clear();
+		m_head = 0;
+	}
+
+	size_t size() const { return m_index.size(); }
+	size_t hits() const { return m_hits; }
+};
+
+// Cache with a second tier on local disk: values evicted from the memory
+// Cache are written to a DiskCache, and hits there are promoted back to
+// memory (leaving the disk). For hot sets bigger than the memory budget,
+// a second tier hit is a pread() of one record instead of a DB file read.
+// capacity(), size() and for_each() (and so snapshots) are of the memory
+// tier only
+class TieredCache : public i_cache {
+   private:
+	std::unique_ptr<Cache> m_memory;
+	std::unique_ptr<DiskCache> m_disk;
+
+   public:
+	TieredCache(std::unique_ptr<Cache> memory, std::unique_ptr<DiskCache> disk)
+		: m_memory(std::move(memory)), m_disk(std::move(disk)) {
+		// cached deletions are not worth disk writes, a put() erases the
+		// key from the disk anyway so nothing stale is left there
+		m_memory->set_eviction_listener(
+			[this](const HashedKey& key,
+				   const std::optional<std::string>& value) {
+				if (value) m_disk->put(key, *value);
+			});
+	}
+	TieredCache(const TieredCache&) = delete;
+	TieredCache& operator=(const TieredCache&) = delete;
+
+	Cache& memory() { return *m_memory; }
+
+	void put(const HashedKey& key,
+			 const std::optional<std::string>& value) override {
+		m_disk->erase(key);
+		m_memory->put(key, value);
+	}
+
+	bool get(const HashedKey& key,
+			 std::optional<std::string>& value) override {
+		if (m_memory->get(key, value)) return true;
+		std::string disk_value;
+		if (!m_disk->get(key, disk_value)) return false;
+		m_disk->erase(key);
+		value = std::move(disk_value);
+		m_memory->put(key, value);
+		return true;
+	}
+
+	void erase(const HashedKey& key) override {
+		m_memory->erase(key);
+		m_disk->erase(key);
+	}
+
+	void clear() override {
+		m_memory->clear();
+		m_disk->clear();
+	}
+
+	size_t capacity() const override { return m_memory->capacity(); }
+	size_t size() const override { return m_memory->size(); }
+	size_t evictions() const override { return m_memory->evictions(); }
+	size_t hits() const override { return m_memory->hits() + m_disk->hits(); }
+	CacheCompressionStats compression_stats() const override {
+		return m_memory->compression_stats();
+	}
+	size_t second_tier_hits() const override { return m_disk->hits(); }
+	size_t second_tier_size() const override { return m_disk->size(); }
+
+	void for_each(
+		const std::function<void(const std::string&,
+								 const std::optional<std::string>&)>& f)
+		const override {
+		m_memory->for_each(f);
+	}
+};
+
+// Bloom filter over a set of keys: may_contain() never returns false for an
+// added key and returns true for an absent one with ~false_positive_rate
+// probability. Keys can't be removed, the owner rebuilds the filter instead.
+// Bits are atomics so lookups are lock-free and safe while keys are added.
+class BloomFilter {
+   private:
+	std::vector<std::atomic<uint64_t>> m_bits;
+	uint64_t m_num_bits;
+	uint32_t m_num_hashes;
+
+	// second independent-enough hash derived from the first (splitmix64)
+	static uint64_t mix(uint64_t h) {
+		h += 0x9e3779b97f4a7c15ULL;
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+		return h ^ (h >> 31);
+	}
+
+   public:
+	BloomFilter(size_t expected_keys, double false_positive_rate = 0.01) {
+		// optimal sizes: m = -n * ln(p) / ln(2)^2, k = m / n * ln(2)
+		double n = static_cast<double>(std::max<size_t>(expected_keys, 1));
+		double ln2 = std::log(2.0);
+		double bits = -n * std::log(false_positive_rate) / (ln2 * ln2);
+		m_num_bits = std::max<uint64_t>(64, static_cast<uint64_t>(bits));
+		m_num_hashes = std::max<uint32_t>(
+			1, static_cast<uint32_t>(std::round(bits / n * ln2)));
+		m_bits = std::vector<std::atomic<uint64_t>>((m_num_bits + 63) / 64);
+	}
+
+	void add(const HashedKey& key) {
+		uint64_t h1 = key.hash;
+		uint64_t h2 = mix(h1) | 1;
+		for (uint32_t i = 0; i < m_num_hashes; ++i) {
+			uint64_t bit = (h1 + i * h2) % m_num_bits;
+			m_bits[bit / 64].fetch_or(1ULL << (bit % 64),
+									  std::memory_order_relaxed);
+		}
+	}
+
+	bool may_contain(const HashedKey& key) const {
+		uint64_t h1 = key.hash;
+		uint64_t h2 = mix(h1) | 1;
+		for (uint32_t i = 0; i < m_num_hashes; ++i) {
+			uint64_t bit = (h1 + i * h2) % m_num_bits;
+			if (!(m_bits[bit / 64].load(std::memory_order_relaxed) &
+				  (1ULL << (bit % 64)))) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// DB file formats.
+// text: "{key}={value}" one per line. keys can't contain '=' and neither
+// keys nor values can contain newlines.
+// binary: 8 byte magic followed by records of varint key length, varint
+// value length, key, value and u32 CRC32C of all preceding record bytes.
+// holds any bytes and detects torn or corrupted records.
+enum class DbFormat { text, binary };
+
+inline constexpr char kBinaryDbMagic[8] = {'D', 'B', 'B', 'I',
+											'N', '0', '0', '1'};
+
+// CRC32C (Castagnoli polynomial, reflected), table driven
+inline uint32_t crc32c(const char* data, size_t size) {
+	static const auto table = [] {
+		std::array<uint32_t, 256> t{};
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit) {
+				crc = (crc >> 1) ^ (0x82F63B78U & (0U - (crc & 1)));
+			}
+			t[i] = crc;
+		}
+		return t;
+	}();
+	uint32_t crc = 0xFFFFFFFFU;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFFU;
+}
+
+// appends a binary format record to `out`
+// returns offset of the value inside `out`
+inline size_t binary_record_append(std::string& out, std::string_view key,
+								   std::string_view value) {
+	size_t start = out.size();
+	varint_append(out, key.size());
+	varint_append(out, value.size());
+	out.append(key);
+	size_t value_offset = out.size();
+	out.append(value);
+	uint32_t crc = crc32c(out.data() + start, out.size() - start);
+	for (int i = 0; i < 4; ++i) {
+		out.push_back(static_cast<char>(crc >> (8 * i)));
+	}
+	return value_offset;
+}
+
+// parses binary format record at `pos`, moving `pos` past it.
+// key and value point into the parsed buffer.
+// returns false if the record is truncated or its checksum doesn't match
+inline bool binary_record_parse(const char*& pos, const char* end,
+								std::string_view& key,
+								std::string_view& value) {
+	const char* start = pos;
+	uint64_t key_size{}, value_size{};
+	if (!varint_parse(pos, end, key_size) ||
+		!varint_parse(pos, end, value_size)) {
+		return false;
+	}
+	if (static_cast<uint64_t>(end - pos) < key_size + value_size + 4) {
+		return false;
+	}
+	key = std::string_view(pos, key_size);
+	value = std::string_view(pos + key_size, value_size);
+	pos += key_size + value_size;
+	uint32_t stored_crc{0};
+	for (int i = 0; i < 4; ++i) {
+		stored_crc |= static_cast<uint32_t>(static_cast<uint8_t>(pos[i]))
+					  << (8 * i);
+	}
+	pos += 4;
+	return stored_crc == crc32c(start, pos - 4 - start);
+}
+
+// converts text format DB file to a new binary format DB file
+// returns false on file errors
+inline bool convert_text_db_to_binary(const std::string& text_file,
+									  const std::string& binary_file) {
+	std::ifstream fin(text_file);
+	if (!fin) {
+		std::cerr << "Error opening file for reading!\n";
+		return false;
+	}
+	std::string contents(kBinaryDbMagic, sizeof(kBinaryDbMagic));
+	std::unordered_set<std::string> seen_keys;
+	std::string line;
+	while (std::getline(fin, line)) {
+		size_t pos = line.find('=');
+		if (pos == std::string::npos) continue;
+		std::string key = line.substr(0, pos);
+		// first occurrence wins, the rest were never readable anyway
+		if (!seen_keys.insert(key).second) continue;
+		binary_record_append(contents, key,
+							 std::string_view(line).substr(pos + 1));
+	}
+	return write_file_atomically(binary_file, contents);
+}
+
+// end of a scan of all keys starting with `prefix`: the first string past
+// them all, its last byte that can be incremented, incremented ("" - none,
+// no upper bound)
+inline std::string prefix_scan_end(const std::string& prefix) {
+	std::string end = prefix;
+	while (!end.empty() && static_cast<uint8_t>(end.back()) == 0xFF) {
+		end.pop_back();
+	}
+	if (!end.empty()) end.back() = static_cast<char>(end.back() + 1);
+	return end;
+}
+
+// Changes of one committed transaction, numbered by commit order
+struct WriteSet {
+	uint64_t sequence{0};
+	std::vector<std::pair<std::string, std::string>> sets;
+	std::vector<std::string> deletes;
+};
+
+// Example database interface implementation with optional caching and thread
+// safety conforming to ACID.
+// Uses simple .txt file as a database by storing "{key}={value}" one per line
+// (or a binary length-prefixed, checksummed record format, see DbFormat),
+// file operations are not optimised (it's better to use real databases like
+// PostgreSQL for that).
+// Each thread has its own thread local transaction data (uncommited changes),
+// but all threads access one file and one cache synchronized using mutexes.
+class CachedFileDatabase : public i_db {
+   private:
+	static constexpr char kSnapshotMagic[8] = {'D', 'B', 'C', 'S',
+											   'N', 'A', 'P', '1'};
+
+	// Cache, or SharedMemoryCache (then also m_shared_cache) once
+	// enable_shared_cache() is called. nullptr if there's no cache
+	std::unique_ptr<i_cache> m_local_cache;
+	std::atomic<SharedMemoryCache*> m_shared_cache{nullptr};
+	// DB mutexes are taken with DB_LOCK_GUARD so their contention can be
+	// profiled (see lock_profiler.hpp)
+	std::mutex m_local_cache_mutex;
+	std::string m_filename;
+	std::mutex m_file_mutex;
+	DbFormat m_format;
+	// where cache snapshots go on shutdown and periodically (empty if off)
+	std::string m_snapshot_path;
+	std::unique_ptr<PeriodicTask> m_snapshot_task;
+	// per-thread counters and latency histograms, see stats()
+	DbMetrics m_metrics;
+	std::unique_ptr<PeriodicTask> m_stats_dump_task;
+
+	// where value of a key is located in the DB file
+	struct FileIndexEntry {
+		uint64_t offset;
+		uint32_t length;
+	};
+	// map<key, value location> of every key in the DB file, so reading a
+	// value is a single pread(). guarded by m_file_mutex
+	std::unordered_map<HashedKey, FileIndexEntry, HashedKeyHash> m_file_index;
+	// the same index in key order for scans, viewing keys and entries of
+	// m_file_index (its nodes never move). guarded by m_file_mutex
+	std::map<std::string_view, const FileIndexEntry*> m_ordered_index;
+	// DB file descriptor for pread(), -1 if file could not be opened.
+	// reopened by every scan and rewrite of the file. guarded by
+	// m_file_mutex
+	int m_fd{-1};
+	// time building the index took when the DB was opened
+	uint64_t m_index_build_ns{0};
+	// filter over keys persisted in the DB file, lets get_key() answer
+	// definite misses without touching the file or m_file_mutex.
+	// replaced (under m_file_mutex) with std::atomic_store when rebuilt,
+	// readers take it with std::atomic_load
+	std::shared_ptr<BloomFilter> m_bloom;
+	// how many more keys can be added to / deleted from the filter before it
+	// is rebuilt (it is sized for twice the keys it is built with, deleted
+	// keys stay in it as false positives). guarded by m_file_mutex
+	size_t m_bloom_budget{0};
+
+	// versions of key stripes (key hash -> stripe), bumped by commits for
+	// stripes of the keys they write: to odd before changing anything and
+	// back to even after. near cache entries remember the (even) version
+	// they were filled at and are valid only while it stays the same, so
+	// commits invalidate other threads' near caches without touching them
+	static constexpr size_t kVersionStripes = 256;
+	struct alignas(64) VersionStripe {
+		std::atomic<uint64_t> version{0};
+	};
+	std::array<VersionStripe, kVersionStripes> m_stripe_versions;
+	std::atomic<bool> m_near_cache_enabled{false};
+	// tells this database's near cache entries from other instances' ones
+	inline static std::atomic<uint64_t> s_next_instance_id{0};
+	const uint64_t m_instance_id;
+
+	// number of the last commit that wrote something (WriteSet::sequence).
+	// written under m_file_mutex
+	std::atomic<uint64_t> m_commit_sequence{0};
+	// called with every committed WriteSet, under m_file_mutex
+	std::function<void(const WriteSet&)> m_commit_listener;
+
+	// writes of committed transactions merged by key, the last one wins
+	// (nullopt - delete)
+	using ChangeSet = std::unordered_map<HashedKey, std::optional<std::string>,
+										 HashedKeyHash>;
+	// Flat-combined commits: a committer publishes its transaction's write
+	// set (its thread locals, untouched until the commit returns) to
+	// m_pending_commits and takes m_file_mutex. Whoever gets the lock first
+	// applies every published write set in one DB file rewrite and one
+	// cache update (commit_pending()), the others find theirs done when
+	// they get the lock in turn
+	struct PendingCommit {
+		const std::unordered_map<HashedKey, std::string, HashedKeyHash>* sets;
+		const std::unordered_set<HashedKey, HashedKeyHash>* deletes;
+		// ts_applied_sequence of the committer, 0 - next one
+		uint64_t applied_sequence;
+		// guarded by m_file_mutex
+		bool done{false};
+		// the DB file couldn't be written, nothing of it was applied
+		bool failed{false};
+	};
+	// taken alone or under m_file_mutex
+	std::mutex m_pending_mutex;
+	std::vector<PendingCommit*> m_pending_commits;
+
+	// Change log shared by processes using the DB file (see
+	// enable_change_notifications()), "<DB file>.changes": u64 generation,
+	// then a record per commit of u32 size and the keys it wrote (varint
+	// count, varint length prefixed keys). Appended under an exclusive
+	// flock() of the log right after the commit writes the DB file, and
+	// read under a shared one. Its writer starts a new generation when it
+	// grows past kMaxChangeLog, readers that missed records of the old one
+	// clear their whole cache. The byte offset of a record in a generation
+	// is its commit sequence number.
+	static constexpr uint64_t kMaxChangeLog = 1024 * 1024;
+	static constexpr int kWatchPollMs = 500;
+	std::string m_changes_path;
+	// -1 if notifications are off. guarded by m_file_mutex
+	int m_changes_fd{-1};
+	// generation and end of the change log applied so far, DB file
+	// fingerprint after them. guarded by m_file_mutex
+	uint64_t m_changes_generation{0};
+	uint64_t m_changes_offset{0};
+	std::pair<uint64_t, uint64_t> m_known_fingerprint{0, 0};
+	// runs sync_external_changes() on inotify events and every kWatchPollMs
+	std::atomic<bool> m_watch_stop{false};
+	std::thread m_watch_thread;
+
+	// Prefetches (see prefetch()): loads of keys into the cache queued on
+	// m_io_pool, by key, while queued or running. A load reads the value
+	// and leaves the map under the lock that keeps the value current (the
+	// cache lock if it was cached, the file lock if read from the file), so
+	// get_key() that finds a key here may wait for its load and use it.
+	// guarded by m_prefetch_mutex (taken alone or innermost)
+	using LoadedValue = std::shared_future<std::optional<std::string>>;
+	std::mutex m_prefetch_mutex;
+	std::unique_ptr<WorkerPool> m_io_pool;
+	std::unordered_map<HashedKey, LoadedValue, HashedKeyHash> m_prefetches;
+	// m_prefetches.size(), so cache misses skip the lock while it's 0
+	std::atomic<size_t> m_prefetches_in_flight{0};
+
+	// flock() of the change log for the scope, no-op for fd -1
+	class ChangeLogLock {
+	   private:
+		int m_fd;
+
+	   public:
+		ChangeLogLock(int fd, int operation) : m_fd(fd) {
+			if (m_fd < 0) return;
+			while (::flock(m_fd, operation) != 0 && errno == EINTR) {
+			}
+		}
+		ChangeLogLock(const ChangeLogLock&) = delete;
+		ChangeLogLock& operator=(const ChangeLogLock&) = delete;
+		~ChangeLogLock() {
+			if (m_fd >= 0) ::flock(m_fd, LOCK_UN);
+		}
+	};
+
+	// per-thread L1 cache in front of the shared cache (see near_cache_*)
+	static constexpr size_t kNearCacheEntries = 256;
+	struct NearCacheEntry {
+		uint64_t db_id{0};
+		uint64_t version{0};
+		std::string key;
+		std::optional<std::string> value;
+	};
+
+	// Thread-locals
+	inline thread_local static bool ts_transaction_active = false;
+	// begun with begin_read_only(): no write set, commit takes no locks
+	inline thread_local static bool ts_transaction_read_only = false;
+	inline thread_local static std::unordered_map<HashedKey, std::string,
+												  HashedKeyHash>
+		ts_transaction_data;
+	inline thread_local static std::unordered_set<HashedKey, HashedKeyHash>
+		ts_transaction_deletes;
+	// committed values the transaction has read ("" - no key), so it keeps
+	// seeing them (repeatable read) and rereads take no locks
+	inline thread_local static std::unordered_map<HashedKey, std::string,
+												  HashedKeyHash>
+		ts_transaction_reads;
+	// direct-mapped near cache, shared by all instances used by the thread
+	inline thread_local static std::vector<NearCacheEntry> ts_near_cache;
+	// sequence the transaction commits with when applied by
+	// apply_write_set(), 0 - next one
+	inline thread_local static uint64_t ts_applied_sequence = 0;
+
+	static size_t stripe_of(size_t hash) {
+		return (hash >> 16) % kVersionStripes;
+	}
+
+	// near cache slot of a key with `hash` (not necessarily holding the key)
+	// not thread-safe (thread-local)
+	NearCacheEntry& near_cache_slot(size_t hash) {
+		if (ts_near_cache.empty()) ts_near_cache.resize(kNearCacheEntries);
+		return ts_near_cache[hash % kNearCacheEntries];
+	}
+
+	// remembers value of a key read from shared cache or file while its
+	// stripe was at `version` (read before the lookup). nothing is cached if
+	// a commit to the stripe was in progress
+	void near_cache_fill(uint64_t version, const HashedKey& key,
+						 const std::optional<std::string>& value) {
+		if (version % 2) return;
+		NearCacheEntry& entry = near_cache_slot(key.hash);
+		entry.db_id = m_instance_id;
+		entry.version = version;
+		entry.key = key.key;
+		entry.value = value;
+	}
+
+	// bumps versions of stripes of `keys`' hashes once each, see
+	// m_stripe_versions. called twice per commit, before and after writing
+	// not thread-safe (call under m_file_mutex)
+	void stripes_bump(const std::vector<size_t>& stripes) {
+		for (size_t stripe : stripes) {
+			m_stripe_versions[stripe].version.fetch_add(1);
+		}
+	}
+
+	// distinct stripes of keys in `changes`
+	static std::vector<size_t> change_stripes(const ChangeSet& changes) {
+		std::vector<size_t> stripes;
+		for (const auto& change : changes) {
+			stripes.push_back(stripe_of(change.first.hash));
+		}
+		std::sort(stripes.begin(), stripes.end());
+		stripes.erase(std::unique(stripes.begin(), stripes.end()),
+					  stripes.end());
+		return stripes;
+	}
+
+	// writes all `changes` to the file in one rewrite
+	// returns false on file errors, the file is left as it was then
+	// not thread-safe
+	bool file_apply(const ChangeSet& changes) {
+		std::vector<std::pair<std::string, std::string>> records;
+		if (!file_scan(&records)) return false;
+
+		// records hold the first record of each key (the only one readable)
+		bool changed{false};
+		size_t kept{0};
+		for (size_t i = 0; i < records.size(); ++i) {
+			HashedKey key(std::move(records[i].first));
+			auto change = changes.find(key);
+			records[i].first = std::move(key.key);
+			if (change != changes.end()) {
+				changed = true;
+				if (!change->second) continue;	// deleted
+				records[i].second = *change->second;
+			}
+			if (kept != i) records[kept] = std::move(records[i]);
+			++kept;
+		}
+		records.resize(kept);
+		for (const auto& [key, value] : changes) {
+			if (value && m_file_index.find(key) == m_file_index.end()) {
+				records.emplace_back(key.key, *value);
+				changed = true;
+			}
+		}
+		if (!changed) return true;	// only deletes of missing keys
+
+		return file_store(records);
+	}
+
+	// reads every record of the DB file in file order, rebuilding the index.
+	// values are collected to `records` unless it's nullptr.
+	// a torn or corrupted tail of a binary file is reported and left out of
+	// the index; `repair` (only when opening or after a failed rewrite,
+	// under the locks of writers) also cuts it off the file
+	// returns false if the file can't be read
+	// not thread-safe
+	bool file_scan(std::vector<std::pair<std::string, std::string>>* records,
+				   bool repair = false) {
+		m_file_index.clear();
+		m_ordered_index.clear();
+		// the index must describe the file m_fd reads, the one at the path
+		// now (rewrites rename a new file over it)
+		file_reopen();
+		struct stat st {};
+		if (m_fd < 0 || ::fstat(m_fd, &st) != 0) {
+			std::cerr << "Error opening file for reading!\n";
+			return false;
+		}
+		size_t size = st.st_size;
+		if (size == 0) return true;	 // new DB, header comes with first write
+		void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if (mapping == MAP_FAILED) {
+			std::cerr << "Error mapping file for reading!\n";
+			return false;
+		}
+		const char* begin = static_cast<const char*>(mapping);
+		const char* end = begin + size;
+		if (m_format == DbFormat::text) {
+			for (const char* line = begin; line < end;) {
+				const char* line_end = static_cast<const char*>(
+					std::memchr(line, '\n', end - line));
+				if (!line_end) line_end = end;
+				std::string_view text(line, line_end - line);
+				size_t pos = text.find('=');
+				if (pos != std::string_view::npos) {
+					file_index_record(std::string(text.substr(0, pos)),
+									  line - begin + pos + 1,
+									  text.size() - pos - 1, records,
+									  text.substr(pos + 1));
+				}
+				line = line_end + 1;
+			}
+			::munmap(mapping, size);
+			return true;
+		}
+		if (size < sizeof(kBinaryDbMagic) ||
+			!std::equal(kBinaryDbMagic, std::end(kBinaryDbMagic), begin)) {
+			std::cerr << "Error: not a binary DB file!\n";
+			::munmap(mapping, size);
+			return false;
+		}
+		const char* pos = begin + sizeof(kBinaryDbMagic);
+		while (pos < end) {
+			const char* record = pos;
+			std::string_view key, value;
+			if (!binary_record_parse(pos, end, key, value)) {
+				// partial write or corruption, the rest can't be trusted
+				std::cerr << "DB file: torn or corrupted record at offset "
+						  << record - begin << ", ignoring " << end - record
+						  << " trailing bytes\n";
+				if (repair) file_truncate(st, record - begin);
+				break;
+			}
+			file_index_record(std::string(key), value.data() - begin,
+							  value.size(), records, value);
+		}
+		::munmap(mapping, size);
+		return true;
+	}
+
+	// opens m_fd on the file at the DB path (-1 if there is none)
+	// not thread-safe
+	void file_reopen() {
+		if (m_fd >= 0) ::close(m_fd);
+		m_fd = ::open(m_filename.c_str(), O_RDONLY);
+	}
+
+	// cuts the DB file scanned (`scanned` - its stat) to `size` bytes,
+	// unless another file was renamed over it meanwhile
+	// not thread-safe
+	void file_truncate(const struct stat& scanned, off_t size) {
+		int fd = ::open(m_filename.c_str(), O_WRONLY);
+		struct stat st {};
+		if (fd < 0 || ::fstat(fd, &st) != 0 || st.st_ino != scanned.st_ino ||
+			st.st_dev != scanned.st_dev || ::ftruncate(fd, size) != 0) {
+			std::cerr << "Error truncating file!\n";
+		}
+		if (fd >= 0) ::close(fd);
+	}
+
+	// adds a record with value at `offset` in the file to the index (and to
+	// `records` if it's not nullptr). first occurrence of a key wins, same
+	// as in a file scan
+	// not thread-safe
+	void file_index_record(
+		std::string key, uint64_t offset, size_t length,
+		std::vector<std::pair<std::string, std::string>>* records,
+		std::string_view value) {
+		auto [it, inserted] = m_file_index.try_emplace(
+			std::move(key),
+			FileIndexEntry{offset, static_cast<uint32_t>(length)});
+		if (inserted) m_ordered_index.emplace(it->first.key, &it->second);
+		if (inserted && records) {
+			records->emplace_back(it->first.key, value);
+		}
+	}
+
+	// rewrites the whole DB file with `records` (atomically, see
+	// write_file_atomically()) and rebuilds the index
+	// returns false if the file can't be written, the old file is still
+	// there then and the index is rebuilt from it
+	// not thread-safe
+	bool file_store(
+		const std::vector<std::pair<std::string, std::string>>& records) {
+		m_file_index.clear();
+		m_ordered_index.clear();
+		std::string contents;
+		if (m_format == DbFormat::binary) {
+			contents.append(kBinaryDbMagic, sizeof(kBinaryDbMagic));
+		}
+		for (const auto& [key, value] : records) {
+			uint64_t offset{0};
+			if (m_format == DbFormat::binary) {
+				offset = binary_record_append(contents, key, value);
+			} else {
+				contents.append(key).append("=");
+				offset = contents.size();
+				contents.append(value).append("\n");
+			}
+			file_index_record(key, offset, value.size(), nullptr, {});
+		}
+
+		// Write back modified content
+		if (!write_file_atomically(m_filename, contents)) {
+			// the index holds offsets into contents never written, index
+			// the file still there (file_scan() reopens it)
+			file_scan(nullptr, true);
+			return false;
+		}
+		file_reopen();
+		return true;
+	}
+
+	// scans the whole DB file once building the key -> value location index
+	// and remembers how long it took (see stats())
+	// not thread-safe
+	void file_build_index() {
+		auto start = std::chrono::steady_clock::now();
+		file_scan(nullptr, true);
+		m_index_build_ns = elapsed_ns(start, std::chrono::steady_clock::now());
+	}
+
+	// approximate heap memory used by the index: nodes (key, entry, next
+	// pointer and cached hash), long keys' buffers, the bucket array and
+	// ordered index nodes (key view, entry pointer, 3 links and color)
+	// not thread-safe
+	size_t file_index_memory() const {
+		constexpr size_t kNodeSize =
+			sizeof(std::pair<const HashedKey, FileIndexEntry>) +
+			sizeof(void*) + sizeof(size_t) +
+			sizeof(std::pair<const std::string_view, const FileIndexEntry*>) +
+			4 * sizeof(void*);
+		size_t bytes = m_file_index.bucket_count() * sizeof(void*);
+		for (const auto& [key, entry] : m_file_index) {
+			bytes += kNodeSize;
+			// std::string keeps short keys inline (SSO)
+			if (key.key.capacity() > std::string().capacity()) {
+				bytes += key.key.capacity() + 1;
+			}
+		}
+		return bytes;
+	}
+
+	// builds a new bloom filter from the index and publishes it to readers
+	// not thread-safe
+	void bloom_rebuild() {
+		size_t capacity = std::max<size_t>(2 * m_file_index.size(), 1024);
+		auto bloom = std::make_shared<BloomFilter>(capacity);
+		for (const auto& [key, entry] : m_file_index) {
+			bloom->add(key);
+		}
+		m_bloom_budget = capacity - m_file_index.size();
+		std::atomic_store(&m_bloom, std::move(bloom));
+	}
+
+	// keeps the bloom filter in sync with a committed set (is_delete false)
+	// or delete of a key, rebuilding it when it gets too full or stale
+	// not thread-safe
+	void bloom_update(bool is_delete, const HashedKey& key) {
+		if (!is_delete) m_bloom->add(key);
+		if (m_bloom_budget > 0) {
+			--m_bloom_budget;
+		} else {
+			bloom_rebuild();
+		}
+	}
+
+	// reads generation of the change log (0 if it has none yet)
+	// not thread-safe (call under m_file_mutex and a change log flock)
+	uint64_t changes_read_generation() {
+		char bytes[8];
+		if (::pread(m_changes_fd, bytes, sizeof(bytes), 0) != sizeof(bytes)) {
+			return 0;
+		}
+		uint64_t generation{0};
+		for (int i = 0; i < 8; ++i) {
+			generation |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i]))
+						  << (8 * i);
+		}
+		return generation;
+	}
+
+	// Applies commits of other processes: rebuilds the index and bloom
+	// filter if the DB file changed and drops the keys they wrote from the
+	// caches. Everything is dropped if the log can't tell which keys changed
+	// (its generation changed, or the file changed without a record, e.g.
+	// by a process with notifications off)
+	// not thread-safe (call under m_file_mutex, m_local_cache_mutex and a
+	// change log flock)
+	void changes_sync() {
+		struct stat st {};
+		if (::fstat(m_changes_fd, &st) != 0) return;
+		uint64_t size = st.st_size;
+		uint64_t generation = changes_read_generation();
+		bool invalidate_all = false;
+		std::vector<HashedKey> keys;
+		if (generation != m_changes_generation || size < m_changes_offset) {
+			invalidate_all = true;
+		} else if (size > m_changes_offset) {
+			std::string records(size - m_changes_offset, '\0');
+			if (::pread(m_changes_fd, records.data(), records.size(),
+						m_changes_offset) !=
+				static_cast<ssize_t>(records.size())) {
+				invalidate_all = true;
+			}
+			const char* pos = records.data();
+			const char* end = pos + records.size();
+			while (!invalidate_all && pos < end) {
+				uint32_t record_size{0};
+				uint64_t count{0};
+				if (end - pos < 4) break;
+				for (int i = 0; i < 4; ++i) {
+					record_size |= static_cast<uint32_t>(
+									   static_cast<uint8_t>(pos[i]))
+								   << (8 * i);
+				}
+				pos += 4;
+				const char* record_end = pos + record_size;
+				if (record_end > end || !varint_parse(pos, record_end, count)) {
+					break;
+				}
+				for (uint64_t i = 0; i < count && !invalidate_all; ++i) {
+					uint64_t key_size{0};
+					if (!varint_parse(pos, record_end, key_size) ||
+						static_cast<uint64_t>(record_end - pos) < key_size) {
+						invalidate_all = true;
+						break;
+					}
+					keys.emplace_back(std::string(pos, key_size));
+					pos += key_size;
+				}
+				pos = record_end;
+			}
+			// a writer died mid-record
+			if (pos < end) invalidate_all = true;
+		}
+		m_changes_generation = generation;
+		m_changes_offset = size;
+
+		auto fingerprint = file_fingerprint();
+		if (fingerprint == m_known_fingerprint && keys.empty() &&
+			!invalidate_all) {
+			return;
+		}
+		if (fingerprint != m_known_fingerprint) {
+			file_scan(nullptr);
+			bloom_rebuild();
+			if (keys.empty()) invalidate_all = true;
+		}
+		m_known_fingerprint = fingerprint;
+
+		std::vector<size_t> stripes;
+		if (invalidate_all) {
+			stripes.resize(kVersionStripes);
+			std::iota(stripes.begin(), stripes.end(), 0);
+		} else {
+			for (const HashedKey& key : keys) {
+				stripes.push_back(stripe_of(key.hash));
+			}
+			std::sort(stripes.begin(), stripes.end());
+			stripes.erase(std::unique(stripes.begin(), stripes.end()),
+						  stripes.end());
+		}
+		stripes_bump(stripes);
+		if (m_local_cache && invalidate_all) m_local_cache->clear();
+		if (m_local_cache && !invalidate_all) {
+			for (const HashedKey& key : keys) m_local_cache->erase(key);
+		}
+		stripes_bump(stripes);
+		ThreadMetrics& metrics = m_metrics.local();
+		if (invalidate_all) {
+			counter_add(metrics.external_full_invalidations);
+		} else {
+			counter_add(metrics.external_invalidations, keys.size());
+		}
+	}
+
+	// changes_sync() if another process committed since the last one (the
+	// change log grew or the DB file changed), so the index isn't behind the
+	// file and values read from it are current. called before file reads,
+	// the watcher may not have caught up yet. `is_log_locked` - the caller
+	// holds a change log flock already
+	// not thread-safe (call under m_file_mutex, not m_local_cache_mutex)
+	void changes_catch_up(bool is_log_locked = false) {
+		if (m_changes_fd < 0) return;
+		struct stat st {};
+		if (::fstat(m_changes_fd, &st) == 0 &&
+			static_cast<uint64_t>(st.st_size) == m_changes_offset &&
+			file_fingerprint() == m_known_fingerprint) {
+			return;
+		}
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		ChangeLogLock changes_lock(is_log_locked ? -1 : m_changes_fd, LOCK_SH);
+		changes_sync();
+	}
+
+	// appends a record of keys the commit wrote to the change log, starting
+	// a new generation if it got too big
+	// not thread-safe (call under m_file_mutex and an exclusive change log
+	// flock, after changes_sync())
+	void changes_append(const ChangeSet& changes) {
+		std::string payload;
+		varint_append(payload, changes.size());
+		for (const auto& change : changes) {
+			varint_append(payload, change.first.key.size());
+			payload.append(change.first.key);
+		}
+		std::string record;
+		uint64_t offset = m_changes_offset;
+		if (offset < 8 || offset + 4 + payload.size() > kMaxChangeLog) {
+			// new generation, readers behind it will clear their caches
+			if (::ftruncate(m_changes_fd, 0) != 0) {
+				std::cerr << "Error truncating change log!\n";
+			}
+			uint64_t generation = ++m_changes_generation;
+			for (int i = 0; i < 8; ++i) {
+				record.push_back(static_cast<char>(generation >> (8 * i)));
+			}
+			offset = 0;
+		}
+		for (int i = 0; i < 4; ++i) {
+			record.push_back(static_cast<char>(payload.size() >> (8 * i)));
+		}
+		record.append(payload);
+		if (::pwrite(m_changes_fd, record.data(), record.size(), offset) !=
+			static_cast<ssize_t>(record.size())) {
+			std::cerr << "Error writing change log!\n";
+		}
+		m_changes_offset = offset + record.size();
+		m_known_fingerprint = file_fingerprint();
+	}
+
+	// waits for changes of the change log or DB file, applying them
+	void watch_changes() {
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd >= 0) {
+			inotify_add_watch(fd, m_changes_path.c_str(), IN_MODIFY);
+			// writers that don't log rename a new DB file into its directory
+			std::string directory =
+				std::filesystem::path(m_filename).parent_path().string();
+			inotify_add_watch(fd, directory.empty() ? "." : directory.c_str(),
+							  IN_MOVED_TO | IN_CLOSE_WRITE);
+		}
+		char events[4096];
+		while (!m_watch_stop.load()) {
+			pollfd watch{fd, POLLIN, 0};
+			if (fd >= 0 && ::poll(&watch, 1, kWatchPollMs) > 0) {
+				while (::read(fd, events, sizeof(events)) > 0) {
+				}
+			} else if (fd < 0) {
+				std::this_thread::sleep_for(
+					std::chrono::milliseconds(kWatchPollMs));
+			}
+			if (m_watch_stop.load()) break;
+			sync_external_changes();
+		}
+		if (fd >= 0) ::close(fd);
+	}
+
+	// get_key() lookup chain, see get_key()
+	std::string lookup_key(const HashedKey& key) {
+		// read-only transactions have no uncommited changes
+		if (ts_transaction_read_only) return lookup_committed_key(key);
+		// 1. check in current transaction uncommited changes
+		if (ts_transaction_deletes.find(key) !=
+			ts_transaction_deletes.end()) {
+			// Key marked for deletion in transaction
+			counter_add(m_metrics.local().transaction_reads);
+			return "";
+		}
+		auto data = ts_transaction_data.find(key);
+		if (data != ts_transaction_data.end()) {
+			// Return uncommitted value
+			counter_add(m_metrics.local().transaction_reads);
+			return data->second;
+		}
+		return lookup_committed_key(key);
+	}
+
+	// get_key() lookup chain past the transaction's own changes (steps 2-7),
+	// remembering the value in the transaction's read set
+	std::string lookup_committed_key(const HashedKey& key) {
+		// 2. check values the transaction already read
+		auto read = ts_transaction_reads.find(key);
+		if (read != ts_transaction_reads.end()) {
+			counter_add(m_metrics.local().repeat_reads);
+			return read->second;
+		}
+		std::string value = lookup_shared_key(key);
+		ts_transaction_reads.emplace(key, value);
+		return value;
+	}
+
+	// get_key() lookup chain past the transaction's state (steps 3-7)
+	std::string lookup_shared_key(const HashedKey& key) {
+		// 3. check this thread's near cache, lock-free
+		bool is_near_cache_on =
+			m_near_cache_enabled.load(std::memory_order_relaxed);
+		uint64_t version{0};
+		if (is_near_cache_on) {
+			version = m_stripe_versions[stripe_of(key.hash)].version.load();
+			const NearCacheEntry& entry = near_cache_slot(key.hash);
+			if (entry.db_id == m_instance_id && entry.version == version &&
+				entry.key == key.key) {
+				counter_add(m_metrics.local().near_cache_hits);
+				return entry.value.value_or("");
+			}
+		}
+		// 4. check bloom filter, lock-free. not with a shared cache: other
+		// processes may have cached keys this filter doesn't know yet
+		if (!m_shared_cache.load(std::memory_order_relaxed) &&
+			!std::atomic_load(&m_bloom)->may_contain(key)) {
+			counter_add(m_metrics.local().bloom_negatives);
+			return "";	// definitely not in a file
+		}
+		// 5. check in cache
+		{
+			DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+			// if local cache exists
+			if (m_local_cache) {
+				std::optional<std::string> tmp_value;
+				bool exists = m_local_cache->get(key, tmp_value);
+				if (exists) {
+					if (is_near_cache_on) {
+						near_cache_fill(version, key, tmp_value);
+					}
+					return tmp_value.value_or("");
+				}
+			}
+		}
+		counter_add(m_metrics.local().cache_misses);
+
+		// 6. wait for a prefetch of the key in flight
+		if (m_prefetches_in_flight.load() > 0) {
+			LoadedValue loading;
+			{
+				DB_LOCK_GUARD(prefetch_lock, m_prefetch_mutex);
+				auto it = m_prefetches.find(key);
+				if (it != m_prefetches.end()) loading = it->second;
+			}
+			if (loading.valid()) {
+				counter_add(m_metrics.local().prefetch_joins);
+				const std::optional<std::string>& value = loading.get();
+				if (is_near_cache_on) {
+					near_cache_fill(version, key, value);
+				}
+				return value.value_or("");
+			}
+		}
+
+		// 7. get from actual file
+		std::optional<std::string> value = file_load(key);
+		if (is_near_cache_on) near_cache_fill(version, key, value);
+		return value.value_or("");
+	}
+
+	// reads a key missed by the cache from the file and caches its value,
+	// under the file lock so a concurrent commit can't be overwritten with
+	// older value. A shared cache is written by other processes too, so the
+	// change log lock is held as well: their commits wait until the value
+	// read here is cached
+	std::optional<std::string> file_load(const HashedKey& key) {
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		bool is_shared = m_shared_cache.load() != nullptr;
+		ChangeLogLock changes_lock(is_shared ? m_changes_fd : -1, LOCK_SH);
+		changes_catch_up(is_shared);
+		std::optional<std::string> value = file_get_value(key);
+		{
+			DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+			if (m_local_cache) m_local_cache->put(key, value);
+		}
+		return value;
+	}
+
+	// prefetch() of a key on m_io_pool: caches its value (unless cached
+	// already) and hands it to get_key() calls waiting for it
+	void prefetch_load(const HashedKey& key,
+					   std::promise<std::optional<std::string>>& loaded) {
+		auto finish = [&](const std::optional<std::string>& value) {
+			{
+				DB_LOCK_GUARD(prefetch_lock, m_prefetch_mutex);
+				m_prefetches.erase(key);
+				m_prefetches_in_flight.store(m_prefetches.size());
+			}
+			loaded.set_value(value);
+		};
+		{
+			DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+			std::optional<std::string> value;
+			if (m_local_cache && m_local_cache->get(key, value)) {
+				finish(value);
+				return;
+			}
+		}
+		finish(file_load(key));
+	}
+
+	static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start,
+							   std::chrono::steady_clock::time_point end) {
+		auto elapsed = end - start;
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+			.count();
+	}
+
+	// identifies DB file contents version by its size and last modification
+	// time, so a cache snapshot is only trusted for the file it was taken from
+	// not thread-safe
+	std::pair<uint64_t, uint64_t> file_fingerprint() {
+		std::error_code ec;
+		uint64_t size = std::filesystem::file_size(m_filename, ec);
+		if (ec) size = 0;
+		auto mtime = std::filesystem::last_write_time(m_filename, ec);
+		uint64_t mtime_ticks =
+			ec ? 0 : static_cast<uint64_t>(mtime.time_since_epoch().count());
+		return {size, mtime_ticks};
+	}
+
+	// gets value from key-value pairs in a file if it exists, std::nullopt
+	// otherwise ("" in case of a file error). looks the key up in the index
+	// and reads the value with a single pread()
+	// not thread-safe
+	std::optional<std::string> file_get_value(const HashedKey& key) {
+		auto it = m_file_index.find(key);
+		if (it == m_file_index.end()) return std::nullopt;  // no key in a file
+		return file_read_value(it->second);
+	}
+
+	// reads value at `entry` of the index ("" in case of a file error)
+	// not thread-safe
+	std::string file_read_value(const FileIndexEntry& entry) {
+		if (m_fd < 0) {
+			std::cerr << "Error opening file for reading!\n";
+			return "";
+		}
+		std::string value(entry.length, '\0');
+		size_t done{0};
+		while (done < value.size()) {
+			ssize_t n = ::pread(m_fd, value.data() + done, value.size() - done,
+								entry.offset + done);
+			if (n <= 0) {
+				std::cerr << "Error reading file!\n";
+				return "";
+			}
+			done += n;
+		}
+		return value;
+	}
+
+	// applies write sets of all pending commits (see PendingCommit) to the
+	// DB file and the cache at once, numbering them in publication order.
+	// if the file can't be written, all of them are marked failed
+	// not thread-safe (call under m_file_mutex)
+	void commit_pending() {
+		std::vector<PendingCommit*> batch;
+		{
+			DB_LOCK_GUARD(pending_lock, m_pending_mutex);
+			batch.swap(m_pending_commits);
+		}
+		ChangeSet changes;
+		for (const PendingCommit* commit : batch) {
+			for (const auto& [key, value] : *commit->sets) {
+				changes[key] = value;
+			}
+			for (const HashedKey& key : *commit->deletes) {
+				changes[key] = std::nullopt;
+			}
+		}
+
+		// locking everything (transacions should appear atomic)
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		// commits of other processes go first, the cache must not keep
+		// what they wrote
+		ChangeLogLock changes_lock(m_changes_fd, LOCK_EX);
+		if (m_changes_fd >= 0) changes_sync();
+		std::vector<size_t> stripes = change_stripes(changes);
+		stripes_bump(stripes);
+
+		if (!file_apply(changes)) {
+			stripes_bump(stripes);
+			for (PendingCommit* commit : batch) {
+				commit->failed = true;
+				commit->done = true;
+			}
+			return;
+		}
+		for (const auto& [key, value] : changes) {
+			bloom_update(!value, key);
+			// write to cache if it exists
+			if (m_local_cache) m_local_cache->put(key, value);
+		}
+		stripes_bump(stripes);
+		if (SharedMemoryCache* shared = m_shared_cache.load()) {
+			shared->set_source(file_fingerprint());
+		}
+		if (m_changes_fd >= 0) changes_append(changes);
+
+		for (PendingCommit* commit : batch) {
+			uint64_t sequence = commit->applied_sequence
+									? commit->applied_sequence
+									: m_commit_sequence.load() + 1;
+			m_commit_sequence.store(sequence);
+			if (m_commit_listener) {
+				WriteSet write_set;
+				write_set.sequence = sequence;
+				for (const auto& [key, value] : *commit->sets) {
+					write_set.sets.emplace_back(key.key, value);
+				}
+				for (const HashedKey& key : *commit->deletes) {
+					write_set.deletes.push_back(key.key);
+				}
+				m_commit_listener(write_set);
+			}
+			commit->done = true;
+		}
+	}
+
+   public:
+	// `format` is used for a new (empty) DB file, existing files keep the
+	// format they were written in
+	CachedFileDatabase(const std::string& file, int cache_size = 0,
+					   DbFormat format = DbFormat::text)
+		: m_filename(file),
+		  m_format(format),
+		  m_instance_id(s_next_instance_id.fetch_add(1) + 1) {
+		// we have cache only if we set its size properly. no cache by default
+		if (cache_size > 0) {
+			m_local_cache = std::make_unique<Cache>(cache_size);
+		}
+		m_fd = ::open(m_filename.c_str(), O_RDONLY);
+		char magic[sizeof(kBinaryDbMagic)];
+		ssize_t n = m_fd < 0 ? -1 : ::pread(m_fd, magic, sizeof(magic), 0);
+		if (n == sizeof(magic) &&
+			std::equal(magic, magic + sizeof(magic), kBinaryDbMagic)) {
+			m_format = DbFormat::binary;
+		} else if (n > 0) {
+			m_format = DbFormat::text;
+		}
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		file_build_index();
+		bloom_rebuild();
+		m_known_fingerprint = file_fingerprint();
+	}
+
+	~CachedFileDatabase() {
+		// pending loads finish first, they use everything else
+		if (m_io_pool) m_io_pool->stop();
+		if (m_watch_thread.joinable()) {
+			m_watch_stop.store(true);
+			m_watch_thread.join();
+		}
+		if (m_changes_fd >= 0) ::close(m_changes_fd);
+		if (m_stats_dump_task) m_stats_dump_task->stop();
+		if (m_snapshot_task) {
+			m_snapshot_task->stop();
+			save_cache_snapshot(m_snapshot_path);
+		}
+		if (m_fd >= 0) ::close(m_fd);
+	}
+
+	// begins new DB transaction
+	// returns false if is already in a transaction
+	// otherwise returns true and cleans thread_local variables
+	virtual bool begin_transaction() override {
+		if (ts_transaction_active) return false;  // Already in a transaction
+		ts_transaction_active = true;
+		ts_transaction_data.clear();
+		ts_transaction_deletes.clear();
+		ts_transaction_reads.clear();
+		return true;
+	}
+
+	// begins new read-only DB transaction: write-set bookkeeping is skipped,
+	// writes are refused, and reads are pinned in the transaction's read set
+	// at the first one of each key (repeatable read). commit is a no-op that
+	// takes no locks
+	// returns false if is already in a transaction
+	bool begin_read_only() {
+		if (ts_transaction_active) return false;
+		// the read set is always left empty by commit / abort
+		ts_transaction_active = true;
+		ts_transaction_read_only = true;
+		return true;
+	}
+
+	// returns false if no transaction is active
+	// otherwise finalizes transaction to DB file and local cache from
+	// thread_local variables containing uncommited changes and returns true.
+	// if the DB file can't be written the transaction is rolled back and
+	// false is returned.
+	// commits waiting for the DB file lock are written together by whichever
+	// of them gets it first (flat combining, see PendingCommit)
+	virtual bool commit_transaction() override {
+		if (!ts_transaction_active) return false;
+
+		ThreadMetrics& metrics = m_metrics.local();
+		if (ts_transaction_read_only ||
+			(ts_transaction_data.empty() && ts_transaction_deletes.empty())) {
+			// nothing to write, no need to lock anything
+			ts_transaction_reads.clear();
+			ts_transaction_read_only = false;
+			ts_transaction_active = false;
+			counter_add(metrics.commits);
+			return true;
+		}
+		auto start = std::chrono::steady_clock::now();
+		PendingCommit commit{&ts_transaction_data, &ts_transaction_deletes,
+							 ts_applied_sequence};
+		{
+			DB_LOCK_GUARD(pending_lock, m_pending_mutex);
+			m_pending_commits.push_back(&commit);
+		}
+		{
+			DB_LOCK_GUARD(file_lock, m_file_mutex);
+			counter_add(metrics.commit_lock_wait_ns,
+						elapsed_ns(start, std::chrono::steady_clock::now()));
+			if (commit.done) {
+				// written by the commit that held the lock before
+				counter_add(metrics.combined_commits);
+			} else {
+				commit_pending();
+			}
+		}
+		if (commit.failed) {
+			abort_transaction();
+			return false;
+		}
+		// Clear transaction state
+		ts_transaction_data.clear();
+		ts_transaction_deletes.clear();
+		ts_transaction_reads.clear();
+		ts_transaction_active = false;
+
+		counter_add(metrics.commits);
+		metrics.commit_latency.record(
+			elapsed_ns(start, std::chrono::steady_clock::now()));
+		return true;
+	}
+
+	// aborts current uncommited changes
+	// returns false if no changes to abort, otherwise true
+	virtual bool abort_transaction() override {
+		if (!ts_transaction_active) return false;
+		counter_add(m_metrics.local().aborts);
+		ts_transaction_data.clear();
+		ts_transaction_deletes.clear();
+		ts_transaction_reads.clear();
+		ts_transaction_read_only = false;
+		ts_transaction_active = false;
+		return true;
+	}
+
+	// gets value given key
+	// first looks for data in uncommited changes, then in values this
+	// transaction already read (so it keeps seeing the same ones), then in
+	// this thread's near cache (if enabled), then in bloom filter of
+	// persisted keys (definite misses end here), then in local cache, then
+	// waits for a prefetch of the key if one is in flight, at last reads from
+	// DB file (and does additional caching).
+	// returns "" if nothing was found / transaction was not started
+	// returns value otherwise
+	virtual std::string get_key(const std::string& key) override {
+		return get_key(HashedKey(key));
+	}
+
+	// get_key() of a key hashed already (the hash is reused by every lookup
+	// step, see HashedKey)
+	std::string get_key(const HashedKey& key) {
+		if (!ts_transaction_active) {
+			// you did not start the transaction!
+			return "";
+		} else {
+			// latency is sampled, clock reads would cost more than a hit
+			thread_local uint32_t t_sample_countdown{0};
+			if (t_sample_countdown-- > 0) return lookup_key(key);
+			t_sample_countdown = DbMetrics::kGetSampleEvery - 1;
+
+			auto start = std::chrono::steady_clock::now();
+			std::string value = lookup_key(key);
+			m_metrics.local().get_latency.record(
+				elapsed_ns(start, std::chrono::steady_clock::now()));
+			return value;
+		}
+	}
+
+	// adds new key-value pair (or modifies existing) to uncommited changes
+	// returns previous value at that key if it exists
+	// returns "" if it doesn't exist or transaction wasn't started / is
+	// read-only
+	virtual std::string set_key(const std::string& key,
+								const std::string& data) override {
+		if (!ts_transaction_active || ts_transaction_read_only) {
+			// you did not start the transaction!
+			return "";
+		} else {
+			HashedKey hashed(key);
+			std::string old_value = get_key(hashed);
+			ts_transaction_deletes.erase(hashed);
+			ts_transaction_data[std::move(hashed)] = data;
+			return old_value;
+		}
+	}
+
+	// adds new key-value pair (or modifies existing) to uncommited changes
+	// without reading the previous value, so nothing is looked up before
+	// commit (see get_committed_key() for when the old value is needed)
+	// returns false if transaction wasn't started / is read-only
+	bool put_key(const std::string& key, const std::string& data) {
+		return put_key(HashedKey(key), data);
+	}
+	bool put_key(HashedKey key, const std::string& data) {
+		if (!ts_transaction_active || ts_transaction_read_only) return false;
+		ts_transaction_deletes.erase(key);
+		ts_transaction_data[std::move(key)] = data;
+		return true;
+	}
+
+	// adds delete key query to uncommited changes without reading the
+	// previous value
+	// returns false if transaction wasn't started / is read-only
+	bool erase_key(const std::string& key) { return erase_key(HashedKey(key)); }
+	bool erase_key(HashedKey key) {
+		if (!ts_transaction_active || ts_transaction_read_only) return false;
+		ts_transaction_data.erase(key);
+		ts_transaction_deletes.insert(std::move(key));
+		return true;
+	}
+
+	// gets committed value of a key, ignoring the transaction's own
+	// uncommited changes: the value put_key()/erase_key() replaced, fetched
+	// only if asked for
+	// returns "" if nothing was found / transaction was not started
+	std::string get_committed_key(const std::string& key) {
+		return get_committed_key(HashedKey(key));
+	}
+	std::string get_committed_key(const HashedKey& key) {
+		if (!ts_transaction_active) return "";
+		return lookup_committed_key(key);
+	}
+
+	// adds delete key query to uncommited changes
+	// returns previous value at that key if it exists
+	// returns "" if it doesn't exist or transaction wasn't started / is
+	// read-only
+	virtual std::string delete_key(const std::string& key) override {
+		if (!ts_transaction_active || ts_transaction_read_only) {
+			// you did not start the transaction!
+			return "";
+		} else {
+			HashedKey hashed(key);
+			std::string old_value = get_key(hashed);
+			ts_transaction_data.erase(hashed);
+			ts_transaction_deletes.insert(std::move(hashed));
+			return old_value;
+		}
+	}
+
+	// Returns up to `limit` (0 - no limit) key-value pairs with keys in
+	// [start, end) (empty `end` - no upper bound) in byte-wise key order, as
+	// the current transaction sees them: its uncommited sets and deletes,
+	// then values it already read (the read set, so a scan agrees with
+	// earlier get_key() calls), then committed pairs. Those are read from
+	// the file under the file lock, walking the ordered index, so a scan
+	// never sees half of a commit. Pairs a scan returns are not added to
+	// the read set, a later get_key() of them may see a newer commit.
+	// returns nothing if transaction was not started
+	std::vector<std::pair<std::string, std::string>> scan(
+		const std::string& start, const std::string& end, size_t limit = 0) {
+		std::vector<std::pair<std::string, std::string>> result;
+		if (!ts_transaction_active) return result;
+		auto is_full = [&result, limit]() {
+			return limit > 0 && result.size() >= limit;
+		};
+		auto in_range = [&start, &end](const std::string& key) {
+			return key >= start && (end.empty() || key < end);
+		};
+
+		// transaction's values in range (nullptr - absent), own changes
+		// first so they win over read ones
+		std::map<std::string_view, const std::string*> own;
+		for (const auto& [key, value] : ts_transaction_data) {
+			if (in_range(key.key)) own.emplace(key.key, &value);
+		}
+		for (const HashedKey& key : ts_transaction_deletes) {
+			if (in_range(key.key)) own.emplace(key.key, nullptr);
+		}
+		for (const auto& [key, value] : ts_transaction_reads) {
+			if (in_range(key.key)) {
+				own.emplace(key.key, value.empty() ? nullptr : &value);
+			}
+		}
+		auto own_it = own.begin();
+		// adds the transaction's values of keys below `key` (all if null)
+		auto add_own_below = [&](const std::string_view* key) {
+			for (; own_it != own.end() && !is_full() &&
+				   (!key || own_it->first < *key);
+				 ++own_it) {
+				if (own_it->second) {
+					result.emplace_back(own_it->first, *own_it->second);
+				}
+			}
+		};
+
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		changes_catch_up();
+		for (auto it = m_ordered_index.lower_bound(start);
+			 it != m_ordered_index.end() && !is_full(); ++it) {
+			std::string_view key = it->first;
+			if (!end.empty() && key >= end) break;
+			add_own_below(&key);
+			if (is_full()) break;
+			if (own_it != own.end() && own_it->first == key) {
+				if (own_it->second) {
+					result.emplace_back(key, *own_it->second);
+				}
+				++own_it;
+				continue;
+			}
+			result.emplace_back(key, file_read_value(*it->second));
+		}
+		add_own_below(nullptr);
+		return result;
+	}
+
+	// scan() of all keys starting with `prefix`
+	std::vector<std::pair<std::string, std::string>> scan_prefix(
+		const std::string& prefix, size_t limit = 0) {
+		return scan(prefix, prefix_scan_end(prefix), limit);
+	}
+
+	// Committed value of a key, read without a transaction for layers that
+	// keep their own (PartitionedDatabase): nothing is added to a read set
+	// and no commit is counted
+	// returns "" if nothing was found
+	std::string read_committed(const HashedKey& key) {
+		return lookup_shared_key(key);
+	}
+
+	// committed pairs scan() would return, read without a transaction like
+	// read_committed()
+	std::vector<std::pair<std::string, std::string>> scan_committed(
+		const std::string& start, const std::string& end, size_t limit = 0) {
+		std::vector<std::pair<std::string, std::string>> result;
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		changes_catch_up();
+		for (auto it = m_ordered_index.lower_bound(start);
+			 it != m_ordered_index.end(); ++it) {
+			if (limit > 0 && result.size() >= limit) break;
+			if (!end.empty() && it->first >= end) break;
+			result.emplace_back(it->first, file_read_value(*it->second));
+		}
+		return result;
+	}
+
+	// Dumps cache contents in LRU order to a binary snapshot file, tagged
+	// with the DB file fingerprint. Writes a temporary file and renames it,
+	// so a crash never leaves a half written snapshot behind.
+	// returns false if there's no cache or on file errors
+	bool save_cache_snapshot(const std::string& path) {
+		std::ostringstream contents;
+		{
+			// both locks so fingerprint and cache match (as in commits)
+			DB_LOCK_GUARD(file_lock, m_file_mutex);
+			DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+			if (!m_local_cache) return false;
+			auto [size, mtime] = file_fingerprint();
+			contents.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+			binary_write_u64(contents, size);
+			binary_write_u64(contents, mtime);
+			m_local_cache->save(contents);
+		}
+		return write_file_atomically(path, contents.str());
+	}
+
+	// Warms cache up from a snapshot made by save_cache_snapshot().
+	// The snapshot is ignored if DB file changed since it was taken.
+	// returns true if the cache was loaded
+	bool load_cache_snapshot(const std::string& path) {
+		std::ifstream fin(path, std::ios::binary);
+		if (!fin) return false;	 // no snapshot yet, cold start
+
+		char magic[sizeof(kSnapshotMagic)];
+		uint64_t size{}, mtime{};
+		if (!fin.read(magic, sizeof(magic)) ||
+			!std::equal(magic, magic + sizeof(magic), kSnapshotMagic) ||
+			!binary_read_u64(fin, size) || !binary_read_u64(fin, mtime)) {
+			std::cerr << "Cache snapshot is malformed, ignoring it\n";
+			return false;
+		}
+
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		if (!m_local_cache) return false;
+		if (file_fingerprint() != std::make_pair(size, mtime)) {
+			std::cerr << "Cache snapshot is stale (DB file changed), "
+						 "ignoring it\n";
+			return false;
+		}
+		if (!m_local_cache->load(fin)) {
+			std::cerr << "Cache snapshot is malformed, ignoring it\n";
+			return false;
+		}
+		return true;
+	}
+
+	// Saves cache snapshot to `path` every `interval` and once more on
+	// destruction. Can only be enabled once.
+	void enable_periodic_snapshots(const std::string& path,
+								   std::chrono::milliseconds interval) {
+		if (m_snapshot_task) return;
+		m_snapshot_path = path;
+		m_snapshot_task = std::make_unique<PeriodicTask>(
+			interval, [this]() { save_cache_snapshot(m_snapshot_path); });
+	}
+
+	// Collects metrics of all threads: get/commit counts, where reads were
+	// answered (transaction, repeat read, near cache, bloom filter, cache,
+	// file), cache hit ratio and evictions, commit lock wait time and
+	// get/commit latency histograms
+	MetricsSnapshot stats() {
+		MetricsSnapshot result = m_metrics.snapshot();
+		{
+			DB_LOCK_GUARD(file_lock, m_file_mutex);
+			result.index_keys = m_file_index.size();
+			result.index_build_ns = m_index_build_ns;
+		}
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		result.gets = result.transaction_reads + result.repeat_reads +
+					  result.near_cache_hits + result.bloom_negatives +
+					  result.cache_misses;
+		if (m_local_cache) {
+			result.gets += m_local_cache->hits();
+			result.cache_hits = m_local_cache->hits();
+			result.cache_evictions = m_local_cache->evictions();
+			result.cache_size = m_local_cache->size();
+			result.cache_compression = m_local_cache->compression_stats();
+			result.second_tier_hits = m_local_cache->second_tier_hits();
+			result.second_tier_size = m_local_cache->second_tier_size();
+		}
+		return result;
+	}
+
+	// approximate heap memory used by the DB file index (walks all of it
+	// under the file lock)
+	size_t index_memory() {
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		return file_index_memory();
+	}
+
+	// Writes stats() as JSON to `path` every `interval`. Can only be enabled
+	// once.
+	void enable_periodic_stats_dump(const std::string& path,
+									std::chrono::milliseconds interval) {
+		if (m_stats_dump_task) return;
+		m_stats_dump_task = std::make_unique<PeriodicTask>(
+			interval,
+			[this, path]() { write_file_atomically(path, stats().to_json()); });
+	}
+
+	// Turns on (or off) per-thread near caches: a few hundred most recently
+	// read keys per thread answered without locks while no commit touched
+	// their stripe. Worth it for hot keys read by many threads, where the
+	// shared cache mutex and LRU updates bounce between cores.
+	void enable_near_cache(bool enabled = true) {
+		m_near_cache_enabled.store(enabled);
+	}
+
+	// Starts `threads` background threads for prefetch() loads. calling it
+	// again has no effect
+	void enable_prefetch(size_t threads = 2) {
+		DB_LOCK_GUARD(prefetch_lock, m_prefetch_mutex);
+		if (!m_io_pool) m_io_pool = std::make_unique<WorkerPool>(threads);
+	}
+
+	// Hints that `keys` will be read soon: queues loads of them into the
+	// cache on the prefetch threads (see enable_prefetch()) and returns
+	// without waiting. get_key() of a key then hits the cache, or waits
+	// for its load if it is still in flight instead of reading it again.
+	// Keys the bloom filter rules out and keys already in flight are
+	// skipped. no-op if prefetch is not enabled
+	void prefetch(const std::vector<std::string>& keys) {
+		std::shared_ptr<BloomFilter> bloom = std::atomic_load(&m_bloom);
+		DB_LOCK_GUARD(prefetch_lock, m_prefetch_mutex);
+		if (!m_io_pool) return;
+		for (const std::string& raw_key : keys) {
+			HashedKey key(raw_key);
+			if (!bloom->may_contain(key)) continue;
+			auto loaded =
+				std::make_shared<std::promise<std::optional<std::string>>>();
+			if (!m_prefetches.emplace(key, loaded->get_future().share())
+					 .second) {
+				continue;  // in flight
+			}
+			counter_add(m_metrics.local().prefetches);
+			m_io_pool->submit([this, key, loaded] {
+				prefetch_load(key, *loaded);
+			});
+		}
+		m_prefetches_in_flight.store(m_prefetches.size());
+	}
+
+	// Keeps cached values of at least `min_size` bytes compressed (0 - turns
+	// compression off), see Cache::set_compression(). stats() show the
+	// compression ratio and time spent (de)compressing.
+	// returns false if there's no cache or it is a shared one
+	bool enable_cache_compression(size_t min_size = 256) {
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		auto* cache = dynamic_cast<Cache*>(m_local_cache.get());
+		if (auto* tiered = dynamic_cast<TieredCache*>(m_local_cache.get())) {
+			cache = &tiered->memory();
+		}
+		if (!cache) return false;
+		cache->set_compression(min_size);
+		return true;
+	}
+
+	// Adds a second cache tier in file `path` on local disk, of up to
+	// `max_bytes`: values evicted from the cache are written there and
+	// promoted back on hits (see TieredCache). Second tier reads happen under
+	// the cache lock, so put the file on a local SSD.
+	// returns false if there's no (in-memory) cache or the file can't be
+	// opened
+	bool enable_disk_cache(const std::string& path, uint64_t max_bytes) {
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		if (!dynamic_cast<Cache*>(m_local_cache.get())) return false;
+		auto disk = DiskCache::open(path, max_bytes);
+		if (!disk) return false;
+		std::unique_ptr<Cache> memory(
+			static_cast<Cache*>(m_local_cache.release()));
+		m_local_cache =
+			std::make_unique<TieredCache>(std::move(memory), std::move(disk));
+		return true;
+	}
+
+	// Replaces the cache with one in POSIX shared memory segment `name`
+	// (created with `capacity` slots of up to `entry_bytes` key and value
+	// bytes if it doesn't exist yet), shared by all local processes that
+	// enable it. The segment is cleared if the DB file changed since the last
+	// write through it. Change notifications are turned on too, every process
+	// must see the others' commits: reads from the file catch up with them
+	// first, and they drop what was written from the segment.
+	// returns false (keeping the current cache) if it or the change log
+	// can't be opened
+	bool enable_shared_cache(const std::string& name, size_t capacity,
+							 size_t entry_bytes = 1024) {
+		if (!enable_change_notifications()) return false;
+		auto cache = SharedMemoryCache::open(name, capacity, entry_bytes);
+		if (!cache) return false;
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		auto fingerprint = file_fingerprint();
+		if (!cache->source_matches(fingerprint)) {
+			cache->clear();
+			cache->set_source(fingerprint);
+		}
+		m_shared_cache = cache.get();
+		m_local_cache = std::move(cache);
+		return true;
+	}
+
+	// Keeps the index and caches in sync with commits other processes (with
+	// notifications on too) make to the same DB file: commits append the
+	// keys they wrote to a change log next to the file, and a background
+	// thread woken by inotify (or every half a second) drops just those keys
+	// from the caches. Changes made without the log clear the whole cache.
+	// Commits of processes with notifications on are also serialized with
+	// each other by the change log lock.
+	// returns false if the change log can't be opened
+	bool enable_change_notifications() {
+		{
+			DB_LOCK_GUARD(file_lock, m_file_mutex);
+			if (m_changes_fd >= 0) return true;
+			m_changes_path = m_filename + ".changes";
+			int fd = ::open(m_changes_path.c_str(),
+							O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+			if (fd < 0) {
+				std::cerr << "Error opening change log " << m_changes_path
+						  << "!\n";
+				return false;
+			}
+			DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+			ChangeLogLock changes_lock(fd, LOCK_EX);
+			m_changes_fd = fd;
+			m_changes_generation = changes_read_generation();
+			if (m_changes_generation == 0) {
+				// new log, so the first commit doesn't start a generation
+				// and make everyone else clear their caches
+				char header[8] = {1};
+				if (::pwrite(fd, header, sizeof(header), 0) == sizeof(header)) {
+					m_changes_generation = 1;
+				}
+			}
+			struct stat st {};
+			m_changes_offset = ::fstat(fd, &st) == 0 ? st.st_size : 0;
+			// catches up with changes since the DB was opened
+			changes_sync();
+		}
+		m_watch_thread = std::thread([this]() { watch_changes(); });
+		return true;
+	}
+
+	// Applies commits other processes made to the DB file since the last
+	// call (see enable_change_notifications()). The watcher thread calls it
+	// on every change, call it directly before reads that must not lag
+	// behind even that
+	void sync_external_changes() {
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		if (m_changes_fd < 0) return;
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		ChangeLogLock changes_lock(m_changes_fd, LOCK_SH);
+		changes_sync();
+	}
+
+	// number of the last commit that wrote something
+	uint64_t commit_sequence() const { return m_commit_sequence.load(); }
+
+	// Sets function called with changes of every commit that writes
+	// something, in commit order. It runs under the DB file lock, so it
+	// must be quick and must not use this database
+	void set_commit_listener(std::function<void(const WriteSet&)> listener) {
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		m_commit_listener = std::move(listener);
+	}
+
+	// Commits `write_set` (of another database) as one transaction, keeping
+	// its sequence number. returns false if the calling thread is in a
+	// transaction or the commit fails
+	bool apply_write_set(const WriteSet& write_set) {
+		if (!begin_transaction()) return false;
+		ts_transaction_data.insert(write_set.sets.begin(),
+								   write_set.sets.end());
+		for (const std::string& key : write_set.deletes) erase_key(key);
+		ts_applied_sequence = write_set.sequence;
+		bool committed = commit_transaction();
+		ts_applied_sequence = 0;
+		return committed;
+	}
+
+	// Reads every key-value pair of the DB file to `records`
+	// returns sequence of the last commit they include
+	uint64_t read_all(
+		std::vector<std::pair<std::string, std::string>>& records) {
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		records.clear();
+		file_scan(&records);
+		return m_commit_sequence.load();
+	}
+
+	// Replaces all DB contents with `records` (made by read_all() of
+	// another database) as of commit `sequence`, clearing the caches
+	// returns false if the DB file can't be written, contents are kept then
+	bool replace_all(
+		const std::vector<std::pair<std::string, std::string>>& records,
+		uint64_t sequence) {
+		DB_LOCK_GUARD(file_lock, m_file_mutex);
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		std::vector<size_t> stripes(kVersionStripes);
+		std::iota(stripes.begin(), stripes.end(), 0);
+		stripes_bump(stripes);
+		if (!file_store(records)) {
+			stripes_bump(stripes);
+			return false;
+		}
+		bloom_rebuild();
+		if (m_local_cache) m_local_cache->clear();
+		stripes_bump(stripes);
+		if (SharedMemoryCache* shared = m_shared_cache.load()) {
+			shared->set_source(file_fingerprint());
+		}
+		m_commit_sequence.store(sequence);
+		return true;
+	}
+
+	// functions for debugging/testing
+	void print_cache() {
+		DB_LOCK_GUARD(local_cache_lock, m_local_cache_mutex);
+		if (!m_local_cache) {
+			std::cout << "no cache.\r\n";
+		} else {
+			m_local_cache->print_self();
+		}
+	}
+	void print_uncommited() {
+		std::cout << "transaction_data: \r\n";
+		for (const auto& pair : ts_transaction_data) {
+			std::cout << pair.first.key << ": " << pair.second << "\r\n";
+		}
+		std::cout << "transaction_deletes: \r\n";
+		for (const HashedKey& key : ts_transaction_deletes) {
+			std::cout << key.key << "\r\n";
+		}
+	}
+};
@@ -0,0 +1,686 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "db_cache.hpp"
+#include "replication.hpp"
+
+// Network front-end for CachedFileDatabase speaking a subset of RESP (the
+// Redis protocol), so redis-cli and redis-benchmark work against it.
+// One event loop thread per core, each with its own epoll instance and its
+// own SO_REUSEPORT listening socket (the kernel spreads connections over
+// them), plus an optional Unix socket all loops accept from. Requests are
+// parsed as views into the receive buffer, all complete commands of one
+// read are run in a single transaction and their replies go out with a
+// single write.
+// With --replicate the server also streams its commits to read replicas,
+// with --replica-of it is one: it applies the primary's commits, refuses
+// writes and refuses reads while its data is older than --max-staleness-ms.
+
+struct ServerConfig {
+	std::string db_file;
+	int cache_size{1000};
+	DbFormat format{DbFormat::text};
+	bool near_cache{false};
+	// follow commits of other processes serving the same DB file
+	bool change_notifications{false};
+	// threads loading MGET keys in parallel (prefetch), 0 - off
+	int prefetch_threads{0};
+	int port{6380};
+	std::string unix_path;
+	// one event loop per core
+	int threads{
+		static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+	// Unix socket replicas connect to (primary), empty - no replication
+	std::string replicate_path;
+	// Unix socket of the primary (replica), empty - not a replica
+	std::string replica_of;
+	int max_staleness_ms{1000};
+};
+
+std::atomic<bool> g_stop{false};
+
+// max size of one bulk string / args of one command, as in Redis
+constexpr size_t kMaxBulkSize = 512 * 1024 * 1024;
+constexpr size_t kMaxArgs = 1024 * 1024;
+// max unparsed input of a connection, so max size of one command (Redis'
+// client-query-buffer-limit)
+constexpr size_t kMaxQueryBuffer = 1024 * 1024 * 1024;
+constexpr size_t kReadChunk = 64 * 1024;
+
+enum class ParseResult { complete, incomplete, error };
+
+// reads a decimal number terminated by \r\n at `pos` of `input`
+ParseResult parse_number(std::string_view input, size_t& pos, int64_t& value) {
+	size_t end = input.find("\r\n", pos);
+	if (end == std::string_view::npos) {
+		return input.size() - pos > 32 ? ParseResult::error
+									   : ParseResult::incomplete;
+	}
+	bool negative = pos < end && input[pos] == '-';
+	size_t i = pos + negative;
+	if (i == end) return ParseResult::error;
+	value = 0;
+	for (; i < end; ++i) {
+		if (input[i] < '0' || input[i] > '9') return ParseResult::error;
+		value = value * 10 + (input[i] - '0');
+		if (value > static_cast<int64_t>(kMaxBulkSize)) {
+			return ParseResult::error;
+		}
+	}
+	if (negative) value = -value;
+	pos = end + 2;
+	return ParseResult::complete;
+}
+
+// Parses one command at the start of `input`: a RESP array of bulk strings
+// or an inline command (space separated words ending with \n).
+// `args` are views into `input`, `consumed` is the command's size
+ParseResult parse_command(std::string_view input,
+						  std::vector<std::string_view>& args,
+						  size_t& consumed) {
+	args.clear();
+	if (input.empty()) return ParseResult::incomplete;
+	if (input[0] != '*') {
+		size_t end = input.find('\n');
+		if (end == std::string_view::npos) {
+			return input.size() > kMaxBulkSize ? ParseResult::error
+											   : ParseResult::incomplete;
+		}
+		std::string_view line = input.substr(0, end);
+		if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+		size_t pos = 0;
+		while (pos < line.size()) {
+			size_t space = line.find(' ', pos);
+			if (space == std::string_view::npos) space = line.size();
+			if (space > pos) args.push_back(line.substr(pos, space - pos));
+			pos = space + 1;
+		}
+		consumed = end + 1;
+		return ParseResult::complete;
+	}
+
+	size_t pos = 1;
+	int64_t count{};
+	ParseResult result = parse_number(input, pos, count);
+	if (result != ParseResult::complete) return result;
+	if (count < 0 || static_cast<size_t>(count) > kMaxArgs) {
+		return ParseResult::error;
+	}
+	for (int64_t i = 0; i < count; ++i) {
+		if (pos >= input.size()) return ParseResult::incomplete;
+		if (input[pos] != '$') return ParseResult::error;
+		int64_t length{};
+		++pos;
+		result = parse_number(input, pos, length);
+		if (result != ParseResult::complete) return result;
+		if (length < 0) return ParseResult::error;
+		// declared too big to ever fit in the query buffer
+		if (pos + length + 2 > kMaxQueryBuffer) return ParseResult::error;
+		if (input.size() - pos < static_cast<size_t>(length) + 2) {
+			return ParseResult::incomplete;
+		}
+		if (input.compare(pos + length, 2, "\r\n") != 0) {
+			return ParseResult::error;
+		}
+		args.push_back(input.substr(pos, length));
+		pos += length + 2;
+	}
+	consumed = pos;
+	return ParseResult::complete;
+}
+
+// RESP reply writers, appending to a connection's output buffer
+void reply_simple(std::string& out, std::string_view status) {
+	out.append("+").append(status).append("\r\n");
+}
+void reply_error(std::string& out, std::string_view message,
+				 std::string_view code = "ERR") {
+	out.append("-").append(code).append(" ").append(message).append("\r\n");
+}
+void reply_integer(std::string& out, int64_t value) {
+	out.append(":").append(std::to_string(value)).append("\r\n");
+}
+void reply_bulk(std::string& out, std::string_view value) {
+	out.append("$").append(std::to_string(value.size())).append("\r\n");
+	out.append(value).append("\r\n");
+}
+void reply_nil(std::string& out) { out.append("$-1\r\n"); }
+void reply_array(std::string& out, size_t size) {
+	out.append("*").append(std::to_string(size)).append("\r\n");
+}
+
+// case-insensitive comparison of a command name to an upper case one
+bool command_is(std::string_view name, std::string_view upper) {
+	if (name.size() != upper.size()) return false;
+	for (size_t i = 0; i < name.size(); ++i) {
+		if (std::toupper(static_cast<unsigned char>(name[i])) != upper[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct Connection {
+	int fd;
+	// received bytes not parsed yet (a partial command at most)
+	std::string in;
+	// replies not written yet, from out_pos on
+	std::string out;
+	size_t out_pos{0};
+	bool close_after_flush{false};
+	bool want_write{false};
+};
+
+// what commands of a batch may do: all, only read (replica) or nothing that
+// touches data (replica too stale to answer reads)
+enum class Access { read_write, read_only, stale };
+
+// Runs one command in the current transaction (none if `access` is stale),
+// appending its reply.
+// The DB can't tell an empty value from a missing key, both are nil.
+// returns false if the connection should be closed after the reply
+bool execute(CachedFileDatabase& db, const std::vector<std::string_view>& args,
+			 Access access, std::string& out) {
+	// reused for keys and values, the DB API takes std::string
+	thread_local std::string t_key;
+	thread_local std::string t_value;
+	std::string_view name = args[0];
+	size_t argc = args.size();
+	auto wrong_args = [&out, name]() {
+		reply_error(out, "wrong number of arguments for '" +
+							 std::string(name) + "' command");
+		return true;
+	};
+	bool is_write = command_is(name, "SET") || command_is(name, "DEL") ||
+					command_is(name, "MSET");
+	bool is_read = command_is(name, "GET") || command_is(name, "EXISTS") ||
+				   command_is(name, "MGET");
+	if (is_write && access != Access::read_write) {
+		reply_error(out, "You can't write against a read only replica.",
+					"READONLY");
+		return true;
+	}
+	if (is_read && access == Access::stale) {
+		reply_error(out, "replica data is older than max staleness");
+		return true;
+	}
+
+	if (command_is(name, "GET")) {
+		if (argc != 2) return wrong_args();
+		t_key.assign(args[1]);
+		std::string value = db.get_key(t_key);
+		value.empty() ? reply_nil(out) : reply_bulk(out, value);
+	} else if (command_is(name, "SET")) {
+		if (argc != 3) return wrong_args();
+		t_key.assign(args[1]);
+		t_value.assign(args[2]);
+		db.put_key(t_key, t_value);
+		reply_simple(out, "OK");
+	} else if (command_is(name, "DEL")) {
+		if (argc < 2) return wrong_args();
+		int64_t deleted{0};
+		for (size_t i = 1; i < argc; ++i) {
+			t_key.assign(args[i]);
+			if (!db.delete_key(t_key).empty()) ++deleted;
+		}
+		reply_integer(out, deleted);
+	} else if (command_is(name, "EXISTS")) {
+		if (argc < 2) return wrong_args();
+		int64_t found{0};
+		for (size_t i = 1; i < argc; ++i) {
+			t_key.assign(args[i]);
+			if (!db.get_key(t_key).empty()) ++found;
+		}
+		reply_integer(out, found);
+	} else if (command_is(name, "MGET")) {
+		if (argc < 2) return wrong_args();
+		if (argc > 2) {
+			// misses of all keys are read in parallel, not one by one
+			thread_local std::vector<std::string> t_keys;
+			t_keys.assign(args.begin() + 1, args.end());
+			db.prefetch(t_keys);
+		}
+		reply_array(out, argc - 1);
+		for (size_t i = 1; i < argc; ++i) {
+			t_key.assign(args[i]);
+			std::string value = db.get_key(t_key);
+			value.empty() ? reply_nil(out) : reply_bulk(out, value);
+		}
+	} else if (command_is(name, "MSET")) {
+		if (argc < 3 || argc % 2 == 0) return wrong_args();
+		for (size_t i = 1; i < argc; i += 2) {
+			t_key.assign(args[i]);
+			t_value.assign(args[i + 1]);
+			db.put_key(t_key, t_value);
+		}
+		reply_simple(out, "OK");
+	} else if (command_is(name, "PING")) {
+		if (argc > 2) return wrong_args();
+		argc == 2 ? reply_bulk(out, args[1]) : reply_simple(out, "PONG");
+	} else if (command_is(name, "ECHO")) {
+		if (argc != 2) return wrong_args();
+		reply_bulk(out, args[1]);
+	} else if (command_is(name, "CONFIG") || command_is(name, "COMMAND")) {
+		// asked by redis-benchmark and redis-cli on connect, nothing to
+		// report
+		reply_array(out, 0);
+	} else if (command_is(name, "QUIT")) {
+		reply_simple(out, "OK");
+		return false;
+	} else {
+		reply_error(out, "unknown command '" + std::string(name) + "'");
+	}
+	return true;
+}
+
+class EventLoop {
+   private:
+	CachedFileDatabase& m_db;
+	// set on replicas, reads are refused while it is staler than
+	// m_max_staleness
+	const ReplicaClient* m_replica;
+	std::chrono::milliseconds m_max_staleness;
+	int m_epoll_fd{-1};
+	// listening sockets of this loop (TCP is its own, Unix is shared)
+	std::vector<int> m_listeners;
+	std::unordered_map<int, std::unique_ptr<Connection>> m_connections;
+
+	void watch(int fd, uint32_t events, int op) {
+		epoll_event event{};
+		event.events = events;
+		event.data.fd = fd;
+		if (epoll_ctl(m_epoll_fd, op, fd, &event) != 0) {
+			std::cerr << "epoll_ctl: " << std::strerror(errno) << "\r\n";
+		}
+	}
+
+	void accept_all(int listener) {
+		while (true) {
+			int fd = accept4(listener, nullptr, nullptr,
+							 SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) return;	 // EAGAIN, or another loop took it
+			int one = 1;
+			// fails harmlessly on Unix sockets
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			auto connection = std::make_unique<Connection>();
+			connection->fd = fd;
+			m_connections[fd] = std::move(connection);
+			watch(fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+		}
+	}
+
+	void close_connection(Connection& connection) {
+		int fd = connection.fd;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+		::close(fd);
+		m_connections.erase(fd);
+	}
+
+	// writes out as much of the output buffer as the socket takes, asks for
+	// EPOLLOUT while some is left. returns false if the connection is gone
+	bool flush(Connection& connection) {
+		while (connection.out_pos < connection.out.size()) {
+			ssize_t n = ::write(connection.fd,
+								connection.out.data() + connection.out_pos,
+								connection.out.size() - connection.out_pos);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				if (errno != EAGAIN) return false;
+				break;
+			}
+			connection.out_pos += n;
+		}
+		bool pending = connection.out_pos < connection.out.size();
+		if (!pending) {
+			connection.out.clear();
+			connection.out_pos = 0;
+			if (connection.close_after_flush) return false;
+		}
+		if (pending != connection.want_write) {
+			connection.want_write = pending;
+			watch(connection.fd,
+				  EPOLLIN | EPOLLRDHUP | (pending ? EPOLLOUT : 0u),
+				  EPOLL_CTL_MOD);
+		}
+		return true;
+	}
+
+	// reads everything available (up to kMaxQueryBuffer of input, the rest
+	// waits for the next call) and runs the complete commands in it as one
+	// transaction. a partial command filling the whole buffer gets an error
+	// and the connection closed. returns false if the connection is gone
+	bool on_readable(Connection& connection) {
+		bool eof = false;
+		while (connection.in.size() < kMaxQueryBuffer) {
+			size_t size = connection.in.size();
+			connection.in.resize(size + kReadChunk);
+			ssize_t n = ::read(connection.fd, connection.in.data() + size,
+							   kReadChunk);
+			connection.in.resize(size + std::max<ssize_t>(n, 0));
+			if (n > 0) continue;
+			if (n == 0) eof = true;
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && errno != EAGAIN) return false;
+			break;
+		}
+
+		std::string_view input = connection.in;
+		std::vector<std::string_view> args;
+		size_t pos{0};
+		bool in_transaction = false;
+		Access access = Access::read_write;
+		if (m_replica) {
+			access = m_replica->staleness() > m_max_staleness
+						 ? Access::stale
+						 : Access::read_only;
+		}
+		while (!connection.close_after_flush) {
+			size_t consumed{0};
+			ParseResult result =
+				parse_command(input.substr(pos), args, consumed);
+			if (result == ParseResult::incomplete) break;
+			if (result == ParseResult::error) {
+				reply_error(connection.out, "Protocol error");
+				connection.close_after_flush = true;
+				break;
+			}
+			pos += consumed;
+			if (args.empty()) continue;	 // blank inline line
+			if (!in_transaction && access != Access::stale) {
+				// replicas only read, their commits need no locks
+				in_transaction = access == Access::read_only
+									 ? m_db.begin_read_only()
+									 : m_db.begin_transaction();
+			}
+			if (!execute(m_db, args, access, connection.out)) {
+				connection.close_after_flush = true;
+			}
+		}
+		if (in_transaction && !m_db.commit_transaction()) {
+			// replies are out already, the client can only be dropped
+			std::cerr << "Error: commit failed, rolled back\r\n";
+			connection.close_after_flush = true;
+		}
+		connection.in.erase(0, pos);
+		if (!connection.close_after_flush &&
+			connection.in.size() >= kMaxQueryBuffer) {
+			reply_error(connection.out, "Protocol error: too big command");
+			connection.close_after_flush = true;
+			std::string().swap(connection.in);
+		}
+		if (eof) connection.close_after_flush = true;
+		return flush(connection);
+	}
+
+   public:
+	EventLoop(CachedFileDatabase& db, const ReplicaClient* replica = nullptr,
+			  std::chrono::milliseconds max_staleness = {})
+		: m_db(db), m_replica(replica), m_max_staleness(max_staleness) {}
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+	~EventLoop() {
+		for (auto& [fd, connection] : m_connections) ::close(fd);
+		for (int fd : m_listeners) ::close(fd);
+		if (m_epoll_fd >= 0) ::close(m_epoll_fd);
+	}
+
+	// opens this loop's TCP listener on `port` (0 - none) and watches the
+	// shared Unix socket `unix_fd` (-1 - none). returns false on errors
+	bool init(int port, int unix_fd) {
+		m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (m_epoll_fd < 0) return false;
+		if (port > 0) {
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+							0);
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+			sockaddr_in address{};
+			address.sin_family = AF_INET;
+			address.sin_port = htons(static_cast<uint16_t>(port));
+			address.sin_addr.s_addr = htonl(INADDR_ANY);
+			if (fd < 0 ||
+				bind(fd, reinterpret_cast<sockaddr*>(&address),
+					 sizeof(address)) != 0 ||
+				listen(fd, SOMAXCONN) != 0) {
+				std::cerr << "Error listening on port " << port << ": "
+						  << std::strerror(errno) << "\r\n";
+				if (fd >= 0) ::close(fd);
+				return false;
+			}
+			m_listeners.push_back(fd);
+			watch(fd, EPOLLIN, EPOLL_CTL_ADD);
+		}
+		if (unix_fd >= 0) {
+			// wake only one loop per incoming connection
+			watch(unix_fd, EPOLLIN | EPOLLEXCLUSIVE, EPOLL_CTL_ADD);
+		}
+		return true;
+	}
+
+	// handles events until g_stop is set
+	void run(int unix_fd) {
+		std::vector<epoll_event> events(256);
+		while (!g_stop.load(std::memory_order_relaxed)) {
+			int n = epoll_wait(m_epoll_fd, events.data(),
+							   static_cast<int>(events.size()), 200);
+			for (int i = 0; i < n; ++i) {
+				int fd = events[i].data.fd;
+				if (fd == unix_fd ||
+					std::find(m_listeners.begin(), m_listeners.end(), fd) !=
+						m_listeners.end()) {
+					accept_all(fd);
+					continue;
+				}
+				auto it = m_connections.find(fd);
+				if (it == m_connections.end()) continue;
+				Connection& connection = *it->second;
+				bool alive = true;
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+					alive = on_readable(connection);
+				}
+				if (alive && events[i].events & EPOLLOUT) {
+					alive = flush(connection);
+				}
+				if (!alive || events[i].events & EPOLLERR) {
+					close_connection(connection);
+				}
+			}
+		}
+	}
+};
+
+// returns listening Unix socket at `path` (replacing a stale one), -1 on
+// errors
+int listen_unix(const std::string& path) {
+	sockaddr_un address{};
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Unix socket path is too long!\r\n";
+		return -1;
+	}
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	::unlink(path.c_str());
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0 ||
+		bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) !=
+			0 ||
+		listen(fd, SOMAXCONN) != 0) {
+		std::cerr << "Error listening on " << path << ": "
+				  << std::strerror(errno) << "\r\n";
+		if (fd >= 0) ::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void print_usage(const char* program) {
+	std::cerr
+		<< "Usage: " << program << " <db file> [options]\r\n"
+		<< "  --port <n>                TCP port, 0 - no TCP (6380)\r\n"
+		<< "  --unix <path>             also listen on a Unix socket\r\n"
+		<< "  --threads <n>             event loops (one per core)\r\n"
+		<< "  --cache-size <n>          cache capacity, 0 - no cache (1000)\r\n"
+		<< "  --near-cache 0|1          per-thread near cache (0)\r\n"
+		<< "  --notify 0|1              follow other processes' commits to "
+		   "the DB file (0)\r\n"
+		<< "  --prefetch-threads <n>    load MGET keys on n threads, 0 - off "
+		   "(0)\r\n"
+		<< "  --format text|binary      format of a new DB file (text)\r\n"
+		<< "  --replicate <path>        serve read replicas on Unix socket "
+		   "<path>\r\n"
+		<< "  --replica-of <path>       be a read replica of the primary "
+		   "serving <path>\r\n"
+		<< "  --max-staleness-ms <n>    replica refuses reads with older "
+		   "data (1000)\r\n";
+}
+
+// returns false on invalid arguments
+bool parse_args(int argc, char* argv[], ServerConfig& config) {
+	if (argc < 2) return false;
+	config.db_file = argv[1];
+	for (int i = 2; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		std::string value = argv[++i];
+		if (arg == "--port") {
+			config.port = std::stoi(value);
+		} else if (arg == "--unix") {
+			config.unix_path = value;
+		} else if (arg == "--threads") {
+			config.threads = std::stoi(value);
+		} else if (arg == "--cache-size") {
+			config.cache_size = std::stoi(value);
+		} else if (arg == "--near-cache") {
+			config.near_cache = std::stoi(value) != 0;
+		} else if (arg == "--notify") {
+			config.change_notifications = std::stoi(value) != 0;
+		} else if (arg == "--prefetch-threads") {
+			config.prefetch_threads = std::stoi(value);
+		} else if (arg == "--format") {
+			if (value != "text" && value != "binary") return false;
+			config.format =
+				value == "binary" ? DbFormat::binary : DbFormat::text;
+		} else if (arg == "--replicate") {
+			config.replicate_path = value;
+		} else if (arg == "--replica-of") {
+			config.replica_of = value;
+		} else if (arg == "--max-staleness-ms") {
+			config.max_staleness_ms = std::stoi(value);
+		} else {
+			return false;
+		}
+	}
+	// a replica can't take writes, so has nothing to replicate
+	if (!config.replicate_path.empty() && !config.replica_of.empty()) {
+		return false;
+	}
+	return config.max_staleness_ms >= 0 && config.threads > 0 &&
+		   config.prefetch_threads >= 0 &&
+		   config.port >= 0 && config.port < 65536 &&
+		   (config.port > 0 || !config.unix_path.empty());
+}
+
+int main(int argc, char* argv[]) {
+	ServerConfig config;
+	try {
+		if (!parse_args(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Error: Invalid number as an argument!\r\n";
+		return 1;
+	}
+
+	std::signal(SIGPIPE, SIG_IGN);
+	std::signal(SIGINT, [](int) { g_stop.store(true); });
+	std::signal(SIGTERM, [](int) { g_stop.store(true); });
+
+	CachedFileDatabase db(config.db_file, config.cache_size, config.format);
+	db.enable_near_cache(config.near_cache);
+	if (config.prefetch_threads > 0) {
+		db.enable_prefetch(config.prefetch_threads);
+	}
+	if (config.change_notifications && !db.enable_change_notifications()) {
+		return 1;
+	}
+	std::unique_ptr<ReplicationPrimary> primary;
+	std::unique_ptr<ReplicaClient> replica;
+	if (!config.replicate_path.empty()) {
+		primary = ReplicationPrimary::start(db, config.replicate_path);
+		if (!primary) return 1;
+	} else if (!config.replica_of.empty()) {
+		replica = std::make_unique<ReplicaClient>(db, config.replica_of);
+	}
+
+	int unix_fd = -1;
+	if (!config.unix_path.empty()) {
+		unix_fd = listen_unix(config.unix_path);
+		if (unix_fd < 0) return 1;
+	}
+	std::vector<std::unique_ptr<EventLoop>> loops;
+	for (int i = 0; i < config.threads; ++i) {
+		loops.push_back(std::make_unique<EventLoop>(
+			db, replica.get(),
+			std::chrono::milliseconds(config.max_staleness_ms)));
+		if (!loops.back()->init(config.port, unix_fd)) return 1;
+	}
+
+	std::cout << "Serving " << config.db_file << " with " << config.threads
+			  << " event loops";
+	if (config.port > 0) std::cout << ", port " << config.port;
+	if (unix_fd >= 0) std::cout << ", " << config.unix_path;
+	if (primary) std::cout << ", replicas on " << config.replicate_path;
+	if (replica) std::cout << ", replica of " << config.replica_of;
+	std::cout << "\r\n";
+
+	std::vector<std::thread> threads;
+	unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+	for (int i = 0; i < config.threads; ++i) {
+		threads.emplace_back(
+			[&loops, i, unix_fd]() { loops[i]->run(unix_fd); });
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(i % cores, &cpus);
+		pthread_setaffinity_np(threads.back().native_handle(), sizeof(cpus),
+							   &cpus);
+	}
+	for (auto& thread : threads) thread.join();
+	loops.clear();
+	if (unix_fd >= 0) {
+		::close(unix_fd);
+		::unlink(config.unix_path.c_str());
+	}
+
+	primary.reset();
+	if (replica) {
+		replica->stop();
+		std::cout << "Replication: " << replica->stats().to_json() << "\r\n";
+	}
+	std::cout << "Stats: " << db.stats().to_json() << "\r\n";
+	print_lock_report(std::cout);
+	return 0;
+}
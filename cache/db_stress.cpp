@@ -0,0 +1,695 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "db_cache.hpp"
+
+// Concurrency stress test and scaling harness for CachedFileDatabase.
+// For every thread count it recreates the DB, runs randomised read-only and
+// read-write transactions from that many threads, records their history
+// (what every read and scan returned and when, what every commit wrote and
+// when) and checks it against a model replaying commits in commit order:
+//   - committed write sets are exactly what transactions wrote, aborted
+//     ones never show up, commit order agrees with real time
+//   - every first read of a key in a transaction is linearizable: it
+//     returns a value the key held at some point during the read
+//   - own writes and repeated reads are seen (read-your-writes,
+//     repeatable read)
+//   - every scan (in a read-only transaction) returns what the transaction
+//     already read for keys it read, and for the other keys the state
+//     after some prefix of the commit order (serializable, it never sees
+//     part of a commit), taken at some point during the scan
+//   - final DB contents, and the file reopened, match the model
+// Transactions are generated from a seed, so a run is reproducible up to
+// thread interleaving (`--yield` perturbs it). Throughput of each thread
+// count is reported with the speedup over the first one.
+
+using Clock = std::chrono::steady_clock;
+
+struct StressConfig {
+	std::string db_file{"stress_db.txt"};
+	DbFormat format{DbFormat::text};
+	int cache_size{100};
+	bool near_cache{true};
+	std::vector<int> thread_counts{1, 2, 4, 8, 16, 32, 64, 128};
+	size_t keys{200};
+	// transactions per thread count, split between its threads
+	size_t transactions{2000};
+	size_t max_txn_ops{4};
+	// proportions of read-only transactions, aborted read-write ones and
+	// scans among operations of read-only ones
+	double read_only{0.3};
+	double abort{0.1};
+	double scan{0.2};
+	size_t max_scan_keys{16};
+	// chance of a std::this_thread::yield() before an operation
+	double yield{0.05};
+	uint64_t seed{1};
+};
+
+// first read of a key in a transaction ("" - no key)
+struct ReadEvent {
+	std::string key;
+	std::string value;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+struct ScanEvent {
+	std::string start;
+	std::string end;
+	std::vector<std::pair<std::string, std::string>> result;
+	// keys in range the transaction read before ("" - no key)
+	std::map<std::string, std::string> pinned;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+struct TxnRecord {
+	int thread{0};
+	size_t index{0};
+	bool committed{false};
+	// last change of each key written, nullopt - delete
+	std::map<std::string, std::optional<std::string>> writes;
+	std::vector<ReadEvent> reads;
+	std::vector<ScanEvent> scans;
+	uint64_t commit_start_ns{0};
+	uint64_t commit_end_ns{0};
+	// commit sequence, 0 - not committed (or wrote nothing)
+	uint64_t sequence{0};
+};
+
+struct ThreadHistory {
+	std::vector<TxnRecord> txns;
+	std::vector<std::string> violations;
+	size_t operations{0};
+};
+
+std::string key_name(size_t key_number) {
+	std::ostringstream name;
+	name << "key" << std::setw(6) << std::setfill('0') << key_number;
+	return name.str();
+}
+
+// values are unique, so a read tells which write it saw
+std::string initial_value(size_t key_number) {
+	return "init." + std::to_string(key_number);
+}
+
+std::string value_name(int thread_id, size_t txn, size_t op) {
+	return "v" + std::to_string(thread_id) + "." + std::to_string(txn) + "." +
+		   std::to_string(op);
+}
+
+// key every read-write transaction of a thread sets to its name, so every
+// write set tells whose it is. scans and reads don't touch it
+std::string marker_key(int thread_id) {
+	return "txn" + std::to_string(thread_id);
+}
+
+std::string txn_name(const TxnRecord& txn) {
+	return "thread " + std::to_string(txn.thread) + " txn " +
+		   std::to_string(txn.index);
+}
+
+void run_thread(int thread_id, int thread_count, const StressConfig& config,
+				CachedFileDatabase& db, Clock::time_point epoch,
+				size_t transactions, ThreadHistory& history) {
+	std::mt19937_64 rng(config.seed * 0x9E3779B97F4A7C15ULL +
+						static_cast<uint64_t>(thread_count) * 1000 +
+						thread_id);
+	std::uniform_real_distribution<double> unit(0, 1);
+	auto coin = [&](double p) { return unit(rng) < p; };
+	auto now_ns = [epoch] {
+		return static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+																 epoch)
+				.count());
+	};
+
+	for (size_t t = 0; t < transactions; ++t) {
+		TxnRecord txn;
+		txn.thread = thread_id;
+		txn.index = t;
+		bool read_only = coin(config.read_only);
+		bool begun = read_only ? db.begin_read_only() : db.begin_transaction();
+		if (!begun) {
+			history.violations.push_back(txn_name(txn) +
+										 ": could not begin transaction");
+			return;
+		}
+		// what the transaction must see for keys it read or wrote
+		std::unordered_map<std::string, std::string> seen;
+		auto observe = [&](const std::string& key, const std::string& value,
+						   uint64_t start, uint64_t end) {
+			auto it = seen.find(key);
+			if (it == seen.end()) {
+				seen.emplace(key, value);
+				txn.reads.push_back(ReadEvent{key, value, start, end});
+			} else if (it->second != value) {
+				history.violations.push_back(
+					txn_name(txn) + ": read " + key + " = \"" + value +
+					"\", own write or earlier read was \"" + it->second +
+					"\"");
+			}
+		};
+		auto write = [&](const std::string& key,
+						 std::optional<std::string> value) {
+			seen[key] = value.value_or("");
+			txn.writes[key] = std::move(value);
+		};
+		if (!read_only) {
+			std::string name = "v" + std::to_string(thread_id) + "." +
+							   std::to_string(t);
+			db.put_key(marker_key(thread_id), name);
+			write(marker_key(thread_id), name);
+		}
+
+		size_t ops = 1 + rng() % config.max_txn_ops;
+		for (size_t i = 0; i < ops; ++i) {
+			if (coin(config.yield)) std::this_thread::yield();
+			++history.operations;
+			if (read_only && coin(config.scan)) {
+				size_t first = rng() % config.keys;
+				size_t count = 1 + rng() % config.max_scan_keys;
+				ScanEvent scan{key_name(first), key_name(first + count), {},
+							   {}, 0, 0};
+				for (const auto& [key, value] : seen) {
+					if (key >= scan.start && key < scan.end) {
+						scan.pinned.emplace(key, value);
+					}
+				}
+				scan.start_ns = now_ns();
+				scan.result = db.scan(scan.start, scan.end);
+				scan.end_ns = now_ns();
+				// earlier reads are repeated by the scan
+				std::map<std::string, std::string> result(
+					scan.result.begin(), scan.result.end());
+				for (const auto& [key, value] : scan.pinned) {
+					auto it = result.find(key);
+					std::string scanned = it == result.end() ? "" : it->second;
+					if (scanned != value) {
+						history.violations.push_back(
+							txn_name(txn) + ": scan returned " + key +
+							" = \"" + scanned + "\", earlier read was \"" +
+							value + "\"");
+					}
+				}
+				txn.scans.push_back(std::move(scan));
+				continue;
+			}
+			std::string key = key_name(rng() % config.keys);
+			int op = read_only ? 0 : static_cast<int>(rng() % 5);
+			std::string value = value_name(thread_id, t, i);
+			// previous value, read before the end time is taken
+			std::string old_value;
+			uint64_t start = now_ns();
+			switch (op) {
+				case 0:
+					old_value = db.get_key(key);
+					observe(key, old_value, start, now_ns());
+					break;
+				case 1:
+					old_value = db.set_key(key, value);
+					observe(key, old_value, start, now_ns());
+					write(key, value);
+					break;
+				case 2:
+					db.put_key(key, value);
+					write(key, value);
+					break;
+				case 3:
+					old_value = db.delete_key(key);
+					observe(key, old_value, start, now_ns());
+					write(key, std::nullopt);
+					break;
+				case 4:
+					db.erase_key(key);
+					write(key, std::nullopt);
+					break;
+			}
+		}
+
+		if (!read_only && coin(config.abort)) {
+			db.abort_transaction();
+		} else {
+			txn.commit_start_ns = now_ns();
+			txn.committed = db.commit_transaction();
+			txn.commit_end_ns = now_ns();
+			if (!txn.committed) {
+				history.violations.push_back(txn_name(txn) +
+											 ": commit failed");
+			}
+		}
+		history.txns.push_back(std::move(txn));
+	}
+}
+
+// writes of one key in commit order
+struct KeyWrites {
+	struct Write {
+		const TxnRecord* txn;
+		std::optional<std::string> value;
+	};
+	std::vector<Write> writes;
+	// min_end_after[i] - earliest end of a commit of writes[i..]
+	std::vector<uint64_t> min_end_after;
+	std::unordered_map<std::string, size_t> index_of_value;
+};
+
+// checks the history of one run against the model (see the top), returns
+// the violations found
+std::vector<std::string> check_history(
+	std::vector<ThreadHistory>& histories,
+	const std::vector<WriteSet>& write_sets,
+	const std::map<std::string, std::string>& initial,
+	const std::map<std::string, std::string>& final_state,
+	const std::map<std::string, std::string>& reopened_state) {
+	std::vector<std::string> violations;
+	for (const auto& history : histories) {
+		violations.insert(violations.end(), history.violations.begin(),
+						  history.violations.end());
+	}
+
+	// 1. match write sets with the transactions that wrote them
+	std::unordered_map<std::string, TxnRecord*> txn_of_value;
+	for (auto& history : histories) {
+		for (TxnRecord& txn : history.txns) {
+			for (const auto& [key, value] : txn.writes) {
+				if (value) txn_of_value[*value] = &txn;
+			}
+		}
+	}
+	// committed write transactions by sequence
+	std::vector<const TxnRecord*> commits;
+	uint64_t first_sequence = write_sets.empty() ? 1 : write_sets[0].sequence;
+	for (const WriteSet& write_set : write_sets) {
+		uint64_t expected = first_sequence + commits.size();
+		if (write_set.sequence != expected) {
+			violations.push_back("commit sequence " +
+								 std::to_string(write_set.sequence) +
+								 ", expected " + std::to_string(expected));
+		}
+		TxnRecord* txn = nullptr;
+		for (const auto& [key, value] : write_set.sets) {
+			auto it = txn_of_value.find(value);
+			if (it != txn_of_value.end()) txn = it->second;
+		}
+		if (!txn) {
+			violations.push_back("commit " +
+								 std::to_string(write_set.sequence) +
+								 " by no known transaction");
+			return violations;
+		}
+		std::map<std::string, std::optional<std::string>> written;
+		for (const auto& [key, value] : write_set.sets) written[key] = value;
+		for (const std::string& key : write_set.deletes) {
+			written[key] = std::nullopt;
+		}
+		if (!txn->committed) {
+			violations.push_back(txn_name(*txn) + ": aborted but committed");
+		} else if (txn->sequence) {
+			violations.push_back(txn_name(*txn) + ": committed twice");
+		} else if (written != txn->writes) {
+			violations.push_back(txn_name(*txn) +
+								 ": commit wrote other changes");
+		}
+		txn->sequence = write_set.sequence;
+		commits.push_back(txn);
+	}
+	for (const auto& history : histories) {
+		for (const TxnRecord& txn : history.txns) {
+			if (txn.committed && !txn.writes.empty() && !txn.sequence) {
+				violations.push_back(txn_name(txn) + ": commit lost");
+			}
+		}
+	}
+	if (!violations.empty()) return violations;
+
+	// 2. commit order agrees with real time: a commit that ended before
+	// another one started has a lower sequence
+	uint64_t max_start{0};
+	for (const TxnRecord* txn : commits) {
+		if (txn->commit_end_ns < max_start) {
+			violations.push_back(txn_name(*txn) +
+								 ": ordered after a commit that started "
+								 "after it ended");
+		}
+		max_start = std::max(max_start, txn->commit_start_ns);
+	}
+
+	// 3. first reads are linearizable: some write of the value (or the
+	// initial one) started committing before the read ended, and no later
+	// write of the key ended before the read started
+	std::unordered_map<std::string, KeyWrites> key_writes;
+	for (const TxnRecord* txn : commits) {
+		for (const auto& [key, value] : txn->writes) {
+			KeyWrites& writes = key_writes[key];
+			if (value) writes.index_of_value[*value] = writes.writes.size();
+			writes.writes.push_back(KeyWrites::Write{txn, value});
+		}
+	}
+	for (auto& [key, writes] : key_writes) {
+		size_t n = writes.writes.size();
+		writes.min_end_after.assign(n + 1, UINT64_MAX);
+		for (size_t i = n; i-- > 0;) {
+			writes.min_end_after[i] =
+				std::min(writes.min_end_after[i + 1],
+						 writes.writes[i].txn->commit_end_ns);
+		}
+	}
+	const KeyWrites no_writes{{}, {UINT64_MAX}, {}};
+	for (const auto& history : histories) {
+		for (const TxnRecord& txn : history.txns) {
+			for (const ReadEvent& read : txn.reads) {
+				auto found = key_writes.find(read.key);
+				const KeyWrites& writes =
+					found == key_writes.end() ? no_writes : found->second;
+				// write i (-1 - initial value) could have been read
+				auto readable = [&](ptrdiff_t i) {
+					if (i >= 0 && writes.writes[i].txn->commit_start_ns >=
+									  read.end_ns) {
+						return false;
+					}
+					return writes.min_end_after[i + 1] >= read.start_ns;
+				};
+				bool ok{false};
+				auto init = initial.find(read.key);
+				if (init != initial.end() && init->second == read.value) {
+					ok = readable(-1);
+				} else if (read.value.empty()) {
+					for (size_t i = 0; i < writes.writes.size() && !ok; ++i) {
+						if (!writes.writes[i].value) ok = readable(i);
+					}
+				} else {
+					auto it = writes.index_of_value.find(read.value);
+					if (it != writes.index_of_value.end()) {
+						ok = readable(it->second);
+					}
+				}
+				if (!ok) {
+					violations.push_back(txn_name(txn) + ": read " +
+										 read.key + " = \"" + read.value +
+										 "\" is not linearizable");
+				}
+			}
+		}
+	}
+
+	// 4. scans see the state after a prefix of the commit order: replay the
+	// model up to the last commit that ended before the scan started, then
+	// try each state up to the last commit that started before it ended.
+	// keys the transaction read before were checked in run_thread()
+	std::vector<const ScanEvent*> scans;
+	for (const auto& history : histories) {
+		for (const TxnRecord& txn : history.txns) {
+			for (const ScanEvent& scan : txn.scans) scans.push_back(&scan);
+		}
+	}
+	// first / last commit count (prefix length) a scan may have seen
+	auto window = [&commits](const ScanEvent& scan) {
+		size_t low{0}, high{0};
+		for (size_t i = 0; i < commits.size(); ++i) {
+			if (commits[i]->commit_end_ns < scan.start_ns) low = i + 1;
+			if (commits[i]->commit_start_ns < scan.end_ns) high = i + 1;
+		}
+		return std::make_pair(low, std::max(low, high));
+	};
+	std::vector<std::pair<size_t, size_t>> windows;
+	for (const ScanEvent* scan : scans) windows.push_back(window(*scan));
+	std::vector<size_t> order(scans.size());
+	for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+	std::sort(order.begin(), order.end(), [&windows](size_t a, size_t b) {
+		return windows[a].first < windows[b].first;
+	});
+	// applies writes of `txn` in [start, end) (empty `end` - no bound)
+	auto apply = [](std::map<std::string, std::string>& state,
+					const TxnRecord& txn, const std::string& start = "",
+					const std::string& end = "") {
+		for (const auto& [key, value] : txn.writes) {
+			if (key < start || (!end.empty() && key >= end)) continue;
+			if (value) {
+				state[key] = *value;
+			} else {
+				state.erase(key);
+			}
+		}
+	};
+	std::map<std::string, std::string> model = initial;
+	size_t applied{0};
+	for (size_t i : order) {
+		const ScanEvent& scan = *scans[i];
+		auto [low, high] = windows[i];
+		for (; applied < low; ++applied) apply(model, *commits[applied]);
+		std::map<std::string, std::string> state(
+			model.lower_bound(scan.start), model.lower_bound(scan.end));
+		auto unpinned = [&scan](std::map<std::string, std::string> pairs) {
+			for (const auto& pinned : scan.pinned) pairs.erase(pinned.first);
+			return pairs;
+		};
+		std::map<std::string, std::string> result =
+			unpinned({scan.result.begin(), scan.result.end()});
+		bool ok = unpinned(state) == result;
+		for (size_t k = low; k < high && !ok; ++k) {
+			apply(state, *commits[k], scan.start, scan.end);
+			ok = unpinned(state) == result;
+		}
+		if (!ok) {
+			violations.push_back("scan [" + scan.start + ", " + scan.end +
+								 ") matches no commit order prefix");
+		}
+	}
+
+	// 5. final contents
+	for (; applied < commits.size(); ++applied) apply(model, *commits[applied]);
+	if (final_state != model) {
+		violations.push_back("final DB contents differ from the model");
+	}
+	if (reopened_state != model) {
+		violations.push_back("reopened DB file differs from the model");
+	}
+	return violations;
+}
+
+// all pairs of `db` in one read-only transaction
+std::map<std::string, std::string> db_contents(CachedFileDatabase& db) {
+	db.begin_read_only();
+	auto pairs = db.scan("", "");
+	db.commit_transaction();
+	return std::map<std::string, std::string>(pairs.begin(), pairs.end());
+}
+
+struct RunResult {
+	int threads{0};
+	size_t transactions{0};
+	size_t operations{0};
+	double seconds{0};
+	uint64_t combined_commits{0};
+	size_t violations{0};
+};
+
+// stress run with `threads` threads on a fresh DB, prints violations
+// returns nullopt if the DB file can't be created
+std::optional<RunResult> run_stress(int threads, const StressConfig& config) {
+	{
+		std::ofstream fout(config.db_file, std::ios::trunc);
+		if (!fout) {
+			std::cerr << "Error opening file for writing!\r\n";
+			return std::nullopt;
+		}
+	}
+	std::map<std::string, std::string> initial;
+	for (size_t k = 0; k < config.keys; ++k) {
+		initial[key_name(k)] = initial_value(k);
+	}
+
+	RunResult run;
+	run.threads = threads;
+	std::vector<ThreadHistory> histories(threads);
+	std::vector<WriteSet> write_sets;
+	std::map<std::string, std::string> final_state;
+	{
+		CachedFileDatabase db(config.db_file, config.cache_size,
+							  config.format);
+		db.enable_near_cache(config.near_cache);
+		db.begin_transaction();
+		for (const auto& [key, value] : initial) db.put_key(key, value);
+		db.commit_transaction();
+		// the listener runs under the DB file lock, one call at a time
+		db.set_commit_listener([&write_sets](const WriteSet& write_set) {
+			write_sets.push_back(write_set);
+		});
+
+		std::vector<std::thread> workers;
+		auto start = Clock::now();
+		for (int i = 0; i < threads; ++i) {
+			size_t transactions =
+				config.transactions / threads +
+				(static_cast<size_t>(i) < config.transactions % threads);
+			workers.emplace_back(run_thread, i, threads, std::cref(config),
+								 std::ref(db), start, transactions,
+								 std::ref(histories[i]));
+		}
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		std::chrono::duration<double> elapsed = Clock::now() - start;
+		run.seconds = elapsed.count();
+		db.set_commit_listener(nullptr);
+		run.combined_commits = db.stats().combined_commits;
+		final_state = db_contents(db);
+	}
+	CachedFileDatabase reopened(config.db_file, 0, config.format);
+	std::map<std::string, std::string> reopened_state =
+		db_contents(reopened);
+
+	for (const auto& history : histories) {
+		run.transactions += history.txns.size();
+		run.operations += history.operations;
+	}
+	std::vector<std::string> violations = check_history(
+		histories, write_sets, initial, final_state, reopened_state);
+	run.violations = violations.size();
+	constexpr size_t kMaxPrinted = 10;
+	for (size_t i = 0; i < violations.size() && i < kMaxPrinted; ++i) {
+		std::cout << "[VIOLATION] " << threads << " threads: "
+				  << violations[i] << "\r\n";
+	}
+	if (violations.size() > kMaxPrinted) {
+		std::cout << "[VIOLATION] " << threads << " threads: ... "
+				  << violations.size() - kMaxPrinted << " more\r\n";
+	}
+	return run;
+}
+
+void print_usage(const char* program) {
+	std::cerr
+		<< "Usage: " << program << " [options]\r\n"
+		<< "  --threads <n,n,...>       thread counts to run "
+		   "(1,2,4,8,16,32,64,128)\r\n"
+		<< "  --transactions <n>        transactions per thread count "
+		   "(2000)\r\n"
+		<< "  --txn-ops <n>             max operations per transaction (4)\r\n"
+		<< "  --keys <n>                distinct keys (200)\r\n"
+		<< "  --read-only <proportion>  read-only transactions (0.3)\r\n"
+		<< "  --abort <proportion>      aborted read-write transactions "
+		   "(0.1)\r\n"
+		<< "  --scan <proportion>       scans in read-only transactions "
+		   "(0.2)\r\n"
+		<< "  --scan-keys <n>           max keys per scan range (16)\r\n"
+		<< "  --yield <proportion>      yields before operations (0.05)\r\n"
+		<< "  --seed <n>                transaction generator seed (1)\r\n"
+		<< "  --cache-size <n>          cache capacity, 0 - no cache (100)\r\n"
+		<< "  --near-cache 0|1          per-thread near cache (1)\r\n"
+		<< "  --db <file>               DB file, recreated (stress_db.txt)\r\n"
+		<< "  --format text|binary      DB file format (text)\r\n";
+}
+
+// returns false on invalid arguments
+bool parse_args(int argc, char* argv[], StressConfig& config) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		std::string value = argv[++i];
+		if (arg == "--threads") {
+			config.thread_counts.clear();
+			std::istringstream list(value);
+			std::string count;
+			while (std::getline(list, count, ',')) {
+				config.thread_counts.push_back(std::stoi(count));
+			}
+		} else if (arg == "--transactions") {
+			config.transactions = std::stoull(value);
+		} else if (arg == "--txn-ops") {
+			config.max_txn_ops = std::stoull(value);
+		} else if (arg == "--keys") {
+			config.keys = std::stoull(value);
+		} else if (arg == "--read-only") {
+			config.read_only = std::stod(value);
+		} else if (arg == "--abort") {
+			config.abort = std::stod(value);
+		} else if (arg == "--scan") {
+			config.scan = std::stod(value);
+		} else if (arg == "--scan-keys") {
+			config.max_scan_keys = std::stoull(value);
+		} else if (arg == "--yield") {
+			config.yield = std::stod(value);
+		} else if (arg == "--seed") {
+			config.seed = std::stoull(value);
+		} else if (arg == "--cache-size") {
+			config.cache_size = std::stoi(value);
+		} else if (arg == "--near-cache") {
+			config.near_cache = std::stoi(value) != 0;
+		} else if (arg == "--db") {
+			config.db_file = value;
+		} else if (arg == "--format") {
+			if (value != "text" && value != "binary") return false;
+			config.format =
+				value == "binary" ? DbFormat::binary : DbFormat::text;
+		} else {
+			return false;
+		}
+	}
+	bool threads_ok = !config.thread_counts.empty() &&
+					  std::all_of(config.thread_counts.begin(),
+								  config.thread_counts.end(),
+								  [](int count) { return count > 0; });
+	return threads_ok && config.keys > 0 && config.max_txn_ops > 0 &&
+		   config.max_scan_keys > 0;
+}
+
+int main(int argc, char* argv[]) {
+	StressConfig config;
+	try {
+		if (!parse_args(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Error: Invalid number as an argument!\r\n";
+		return 1;
+	}
+
+	std::vector<RunResult> runs;
+	for (int threads : config.thread_counts) {
+		std::optional<RunResult> run = run_stress(threads, config);
+		if (!run) return 1;
+		runs.push_back(*run);
+	}
+
+	std::cout << "seed " << config.seed << ", " << config.keys << " keys, "
+			  << config.transactions << " transactions of up to "
+			  << config.max_txn_ops << " operations, cache size "
+			  << config.cache_size << ", near cache " << config.near_cache
+			  << "\r\n";
+	size_t violations{0};
+	double base_rate = runs[0].transactions / runs[0].seconds;
+	for (const RunResult& run : runs) {
+		double rate = run.transactions / run.seconds;
+		std::cout << "[THREADS " << run.threads << "] " << std::fixed
+				  << std::setprecision(1) << rate << " txn/sec, "
+				  << run.operations / run.seconds << " ops/sec, speedup "
+				  << std::setprecision(2) << rate / base_rate
+				  << ", combined commits " << run.combined_commits << ", "
+				  << (run.violations ? std::to_string(run.violations) +
+										   " violations"
+									 : std::string("history ok"))
+				  << "\r\n";
+		violations += run.violations;
+	}
+	print_lock_report(std::cout);
+	return violations ? 1 : 0;
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Base of objects freed through EpochManager: the eras the object was
+// allocated and retired in, stamped by EpochManager::make() and retire()
+struct Reclaimable {
+	uint64_t birth_era{0};
+	uint64_t retire_era{0};
+	virtual ~Reclaimable() = default;
+};
+
+// Epoch-based memory reclamation for lock-free structures, interval based
+// (2GE-IBR) so a stalled thread can't hold on to an unbounded amount of
+// memory.
+// A global era counter advances every kEraFrequency allocations of a
+// thread. A thread reading shared memory pins a Guard, which reserves the
+// interval of eras [lower, upper]: lower is the era at pin time, and every
+// pointer read through Guard::protect() extends upper to the current era.
+// Writers retire() objects they unlinked instead of deleting them; a retired
+// object lived during [birth_era, retire_era] and is freed once no reserved
+// interval overlaps that. Plain epoch schemes wait for every thread to
+// leave an old epoch, so one thread stuck in a guard stops all reclamation;
+// here it only keeps objects that were alive while it was reading, anything
+// allocated after its upper era is still freed.
+// Retired objects are kept in per-thread lists and freed in batches of
+// kReclaimBatch, a reclaiming thread also sweeps lists of other (possibly
+// exited) threads.
+class EpochManager {
+   private:
+	static constexpr uint64_t kIdle = std::numeric_limits<uint64_t>::max();
+
+	// per-thread state, cache line aligned so pinning doesn't bounce lines
+	struct alignas(64) ThreadRecord {
+		std::thread::id owner;
+		// reserved eras, lower is kIdle when not in an operation
+		std::atomic<uint64_t> lower{kIdle};
+		std::atomic<uint64_t> upper{kIdle};
+		// nesting depth of guards and allocation count, owner thread only
+		int pins{0};
+		uint32_t allocations{0};
+		// taken by the owner to retire and by any thread to reclaim
+		std::mutex retired_mutex;
+		std::vector<Reclaimable*> retired;
+	};
+
+	std::atomic<uint64_t> m_era{1};
+	std::atomic<size_t> m_pending{0};
+	std::atomic<uint64_t> m_reclaimed{0};
+	std::mutex m_records_mutex;
+	std::vector<std::unique_ptr<ThreadRecord>> m_records;
+	// unique per instance, so thread_local record pointers of a destroyed
+	// manager at the same address are never reused
+	inline static std::atomic<uint64_t> s_next_id{0};
+	const uint64_t m_id;
+
+	// thread_local slots local() caches records in (managers with ids this
+	// far apart share one)
+	static constexpr size_t kLocalSlots = 64;
+
+	// record of the calling thread. slots are picked by manager id, so a
+	// thread using several managers in turn (like one map per partition)
+	// doesn't keep evicting one for another and taking the registry mutex
+	ThreadRecord& local() {
+		struct Slot {
+			uint64_t owner_id{0};
+			ThreadRecord* record{nullptr};
+		};
+		thread_local Slot t_slots[kLocalSlots];
+		Slot& slot = t_slots[m_id % kLocalSlots];
+		if (slot.owner_id == m_id) return *slot.record;
+
+		std::lock_guard<std::mutex> lock(m_records_mutex);
+		auto id = std::this_thread::get_id();
+		auto it = std::find_if(m_records.begin(), m_records.end(),
+							   [id](const auto& r) { return r->owner == id; });
+		if (it == m_records.end()) {
+			m_records.push_back(std::make_unique<ThreadRecord>());
+			m_records.back()->owner = id;
+			it = std::prev(m_records.end());
+		}
+		slot.owner_id = m_id;
+		slot.record = it->get();
+		return *slot.record;
+	}
+
+	// frees retired objects of all threads no reserved interval overlaps
+	void reclaim() {
+		std::vector<ThreadRecord*> records;
+		{
+			std::lock_guard<std::mutex> lock(m_records_mutex);
+			for (const auto& record : m_records) {
+				records.push_back(record.get());
+			}
+		}
+		for (ThreadRecord* record : records) {
+			// a list being reclaimed by someone else is skipped
+			std::unique_lock<std::mutex> lock(record->retired_mutex,
+											  std::try_to_lock);
+			if (!lock.owns_lock() || record->retired.empty()) continue;
+			std::vector<Reclaimable*> retired;
+			retired.swap(record->retired);
+			lock.unlock();
+
+			// reservations are read after the objects were retired, so
+			// a thread pinning later can't reach any of them. from all
+			// records, not the ones above: a thread that registered since
+			// may have pinned before the objects were retired
+			std::vector<std::pair<uint64_t, uint64_t>> reserved;
+			{
+				std::lock_guard<std::mutex> records_lock(m_records_mutex);
+				for (const auto& r : m_records) {
+					uint64_t lower = r->lower.load();
+					uint64_t upper = r->upper.load();
+					if (lower != kIdle) reserved.emplace_back(lower, upper);
+				}
+			}
+			auto in_use = [&reserved](const Reclaimable* object) {
+				return std::any_of(
+					reserved.begin(), reserved.end(), [object](auto& r) {
+						return object->birth_era <= r.second &&
+							   object->retire_era >= r.first;
+					});
+			};
+			auto freeable =
+				std::partition(retired.begin(), retired.end(), in_use);
+			size_t freed = retired.end() - freeable;
+			for (auto it = freeable; it != retired.end(); ++it) delete *it;
+			retired.erase(freeable, retired.end());
+			m_pending.fetch_sub(freed, std::memory_order_relaxed);
+			m_reclaimed.fetch_add(freed, std::memory_order_relaxed);
+
+			// still reserved ones go back to the list
+			if (!retired.empty()) {
+				std::lock_guard<std::mutex> relock(record->retired_mutex);
+				record->retired.insert(record->retired.end(),
+									   retired.begin(), retired.end());
+			}
+		}
+	}
+
+   public:
+	// retire list size at which a thread tries to reclaim
+	static constexpr size_t kReclaimBatch = 64;
+	// allocations of a thread between era increments
+	static constexpr uint32_t kEraFrequency = 128;
+
+	// reserves eras while alive, pointers to shared objects must be read
+	// through protect(). Guards nest
+	class Guard {
+	   private:
+		EpochManager& m_manager;
+		ThreadRecord& m_record;
+
+	   public:
+		explicit Guard(EpochManager& manager)
+			: m_manager(manager), m_record(manager.local()) {
+			if (m_record.pins++ == 0) {
+				// upper first, a reclaimer reading the new lower then sees
+				// the new upper too
+				uint64_t era = manager.m_era.load();
+				m_record.upper.store(era);
+				m_record.lower.store(era);
+			}
+		}
+		Guard(const Guard&) = delete;
+		Guard& operator=(const Guard&) = delete;
+		~Guard() {
+			if (--m_record.pins == 0) m_record.lower.store(kIdle);
+		}
+
+		// loads `link` (a pointer or tagged pointer) so that the object it
+		// points to stays valid until the guard is released
+		template <typename T>
+		T protect(const std::atomic<T>& link) {
+			uint64_t reserved = m_record.upper.load(std::memory_order_relaxed);
+			while (true) {
+				T value = link.load(std::memory_order_acquire);
+				uint64_t era = m_manager.m_era.load();
+				if (era == reserved) return value;
+				m_record.upper.store(era);
+				reserved = era;
+			}
+		}
+	};
+
+	EpochManager() : m_id(s_next_id.fetch_add(1) + 1) {}
+	EpochManager(const EpochManager&) = delete;
+	EpochManager& operator=(const EpochManager&) = delete;
+	// frees everything still retired, no thread may be using the structures
+	// anymore
+	~EpochManager() {
+		for (auto& record : m_records) {
+			for (Reclaimable* object : record->retired) delete object;
+		}
+	}
+
+	Guard pin() { return Guard(*this); }
+
+	// allocates an object whose memory is managed through retire()
+	template <typename T, typename... Args>
+	T* make(Args&&... args) {
+		ThreadRecord& record = local();
+		if (++record.allocations % kEraFrequency == 0) m_era.fetch_add(1);
+		T* object = new T(std::forward<Args>(args)...);
+		object->birth_era = m_era.load(std::memory_order_relaxed);
+		return object;
+	}
+
+	// schedules `object` (allocated by make() and already unreachable for
+	// new readers) for deletion
+	void retire(const Reclaimable* object) {
+		auto* retired = const_cast<Reclaimable*>(object);
+		retired->retire_era = m_era.load();
+		ThreadRecord& record = local();
+		size_t count;
+		{
+			std::lock_guard<std::mutex> lock(record.retired_mutex);
+			record.retired.push_back(retired);
+			count = record.retired.size();
+		}
+		m_pending.fetch_add(1, std::memory_order_relaxed);
+		// every batch, not every retire past it: with a stalled thread some
+		// objects stay on the list for long
+		if (count % kReclaimBatch == 0) reclaim();
+	}
+
+	// retired objects not freed yet
+	size_t pending() const { return m_pending.load(std::memory_order_relaxed); }
+	uint64_t reclaimed() const {
+		return m_reclaimed.load(std::memory_order_relaxed);
+	}
+};
@@ -0,0 +1,312 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "epoch.hpp"
+
+// Stress test of EpochManager. For every thread count it runs two phases on
+// a table of slots, each holding a node allocated through the manager:
+//   - churn: threads replace nodes of random slots (retiring the old ones)
+//     or read them under a guard, checking every node read is alive and
+//     belongs to its slot (a freed and reused node would not)
+//   - stall: the same churn while one more thread pins a guard and sleeps
+//     in it. Reclamation must go on, and nodes retired but not freed must
+//     stay within a bound however long it sleeps. Every thread may hold a
+//     reservation (a worker preempted in a guard is stalled too), which
+//     keeps nodes alive during its two eras at most: the slots and nodes
+//     born meanwhile (up to kEraFrequency per thread and era). Retire lists
+//     not swept yet add kReclaimBatch per thread, twice for lists being
+//     swept meanwhile
+// After each phase every retired node must be either freed or pending.
+// Build it with -fsanitize=address to have use after free reported too.
+
+using Clock = std::chrono::steady_clock;
+
+struct EpochStressConfig {
+	std::vector<int> thread_counts{1, 2, 4, 8, 16, 32};
+	size_t slots{1024};
+	// churn operations per thread count, split between its threads
+	size_t operations{400000};
+	// proportion of operations replacing a node
+	double write{0.2};
+	// how long the stalled thread sleeps in its guard
+	int stall_ms{200};
+	uint64_t seed{1};
+};
+
+constexpr uint64_t kAlive = 0x6c697665'6e6f6465;
+
+struct StressNode : Reclaimable {
+	uint64_t canary{kAlive};
+	// slot index in the high half, replacement count in the low one
+	uint64_t value;
+
+	explicit StressNode(uint64_t value) : value(value) {}
+	~StressNode() override { canary = 0; }
+};
+
+struct PhaseResult {
+	size_t operations{0};
+	size_t retired{0};
+	double seconds{0};
+	// pending() right before, and the highest sampled during the phase
+	size_t pending_before{0};
+	size_t max_pending{0};
+	uint64_t reclaimed{0};
+};
+
+struct RunResult {
+	int threads{0};
+	PhaseResult churn;
+	PhaseResult stall;
+	size_t stall_bound{0};
+	size_t violations{0};
+};
+
+struct StressTable {
+	EpochManager epoch;
+	std::vector<std::atomic<StressNode*>> slots;
+	std::atomic<size_t> retired{0};
+	std::atomic<size_t> bad_reads{0};
+
+	explicit StressTable(size_t size) : slots(size) {
+		for (size_t i = 0; i < size; ++i) {
+			slots[i].store(epoch.make<StressNode>(uint64_t{i} << 32));
+		}
+	}
+	~StressTable() {
+		for (auto& slot : slots) epoch.retire(slot.load());
+	}
+};
+
+// one churn operation on a random slot
+void churn_once(StressTable& table, std::mt19937_64& random,
+				const EpochStressConfig& config) {
+	std::uniform_int_distribution<size_t> pick(0, table.slots.size() - 1);
+	std::uniform_real_distribution<double> chance(0.0, 1.0);
+	size_t slot = pick(random);
+	auto guard = table.epoch.pin();
+	StressNode* node = guard.protect(table.slots[slot]);
+	if (node->canary != kAlive || node->value >> 32 != slot) {
+		table.bad_reads.fetch_add(1, std::memory_order_relaxed);
+	}
+	if (chance(random) < config.write) {
+		uint64_t count = (node->value + 1) & 0xffffffffull;
+		StressNode* replacement = table.epoch.make<StressNode>(
+			(node->value & ~0xffffffffull) | count);
+		// others may have replaced it meanwhile, retire whatever was there
+		table.epoch.retire(table.slots[slot].exchange(replacement));
+		table.retired.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+// runs churn from `threads` threads, `operations` in total, or until
+// `stop` is set if it's given. samples pending() meanwhile
+PhaseResult run_phase(StressTable& table, int threads, size_t operations,
+					  const std::atomic<bool>* stop,
+					  const EpochStressConfig& config, uint64_t seed) {
+	PhaseResult phase;
+	phase.pending_before = table.epoch.pending();
+	size_t retired_before = table.retired.load();
+	uint64_t reclaimed_before = table.epoch.reclaimed();
+	std::atomic<size_t> done{0};
+	std::atomic<int> running{threads};
+
+	std::vector<std::thread> workers;
+	auto start = Clock::now();
+	for (int i = 0; i < threads; ++i) {
+		size_t count = operations / threads +
+					   (static_cast<size_t>(i) < operations % threads);
+		workers.emplace_back([&, i, count]() {
+			std::mt19937_64 random(seed * 1000003 + i);
+			size_t n = 0;
+			for (; stop ? !stop->load() : n < count; ++n) {
+				churn_once(table, random, config);
+			}
+			done.fetch_add(n);
+			running.fetch_sub(1);
+		});
+	}
+	while (running.load() > 0) {
+		phase.max_pending = std::max(phase.max_pending, table.epoch.pending());
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+	phase.seconds = elapsed.count();
+	phase.max_pending = std::max(phase.max_pending, table.epoch.pending());
+	phase.operations = done.load();
+	phase.retired = table.retired.load() - retired_before;
+	phase.reclaimed = table.epoch.reclaimed() - reclaimed_before;
+	return phase;
+}
+
+// every retired node must be freed or pending
+bool accounted(const StressTable& table) {
+	return table.epoch.reclaimed() + table.epoch.pending() ==
+		   table.retired.load();
+}
+
+RunResult run_stress(int threads, const EpochStressConfig& config) {
+	RunResult run;
+	run.threads = threads;
+	std::vector<std::string> violations;
+	StressTable table(config.slots);
+
+	run.churn = run_phase(table, threads, config.operations, nullptr, config,
+						  config.seed);
+	if (!accounted(table)) {
+		violations.push_back("churn: retired nodes lost track of");
+	}
+
+	// the stalled reader pins, reads a node and sleeps in the guard
+	std::atomic<bool> stalled{false};
+	std::atomic<bool> stop{false};
+	std::thread staller([&]() {
+		auto guard = table.epoch.pin();
+		StressNode* node = guard.protect(table.slots[0]);
+		stalled.store(true);
+		std::this_thread::sleep_for(std::chrono::milliseconds(config.stall_ms));
+		if (node->canary != kAlive || node->value >> 32 != 0) {
+			violations.push_back("stall: node held by the stalled reader was "
+								 "freed");
+		}
+		stop.store(true);
+	});
+	while (!stalled.load()) {
+		std::this_thread::yield();
+	}
+	run.stall =
+		run_phase(table, threads, 0, &stop, config, config.seed + 1);
+	staller.join();
+	if (!accounted(table)) {
+		violations.push_back("stall: retired nodes lost track of");
+	}
+
+	size_t reserved_per_thread =
+		config.slots + 2 * threads * EpochManager::kEraFrequency;
+	run.stall_bound = (threads + 1) * reserved_per_thread +
+					  2 * threads * EpochManager::kReclaimBatch;
+	if (run.stall.max_pending > run.stall_bound) {
+		violations.push_back(
+			"stall: " + std::to_string(run.stall.max_pending) +
+			" nodes pending, bound " + std::to_string(run.stall_bound));
+	}
+	// with more retired than the bound, some must have been freed
+	if (run.stall.retired > run.stall_bound && run.stall.reclaimed == 0) {
+		violations.push_back("stall: nothing reclaimed while stalled");
+	}
+	size_t bad_reads = table.bad_reads.load();
+	if (bad_reads > 0) {
+		violations.push_back(std::to_string(bad_reads) +
+							 " reads of freed or foreign nodes");
+	}
+
+	run.violations = violations.size();
+	for (const std::string& violation : violations) {
+		std::cout << "[VIOLATION] " << threads << " threads: " << violation
+				  << "\r\n";
+	}
+	return run;
+}
+
+void print_usage(const char* program) {
+	std::cerr
+		<< "Usage: " << program << " [options]\r\n"
+		<< "  --threads <n,n,...>       thread counts to run "
+		   "(1,2,4,8,16,32)\r\n"
+		<< "  --operations <n>          churn operations per thread count "
+		   "(400000)\r\n"
+		<< "  --slots <n>               nodes in the table (1024)\r\n"
+		<< "  --write <proportion>      operations replacing a node (0.2)\r\n"
+		<< "  --stall-ms <n>            time a reader stalls in a guard "
+		   "(200)\r\n"
+		<< "  --seed <n>                operation generator seed (1)\r\n";
+}
+
+// returns false on invalid arguments
+bool parse_args(int argc, char* argv[], EpochStressConfig& config) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		std::string value = argv[++i];
+		if (arg == "--threads") {
+			config.thread_counts.clear();
+			std::istringstream list(value);
+			std::string count;
+			while (std::getline(list, count, ',')) {
+				config.thread_counts.push_back(std::stoi(count));
+			}
+		} else if (arg == "--operations") {
+			config.operations = std::stoull(value);
+		} else if (arg == "--slots") {
+			config.slots = std::stoull(value);
+		} else if (arg == "--write") {
+			config.write = std::stod(value);
+		} else if (arg == "--stall-ms") {
+			config.stall_ms = std::stoi(value);
+		} else if (arg == "--seed") {
+			config.seed = std::stoull(value);
+		} else {
+			return false;
+		}
+	}
+	bool threads_ok = !config.thread_counts.empty() &&
+					  std::all_of(config.thread_counts.begin(),
+								  config.thread_counts.end(),
+								  [](int count) { return count > 0; });
+	return threads_ok && config.slots > 0 && config.stall_ms >= 0;
+}
+
+int main(int argc, char* argv[]) {
+	EpochStressConfig config;
+	try {
+		if (!parse_args(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Error: Invalid number as an argument!\r\n";
+		return 1;
+	}
+
+	std::vector<RunResult> runs;
+	for (int threads : config.thread_counts) {
+		runs.push_back(run_stress(threads, config));
+	}
+
+	std::cout << "seed " << config.seed << ", " << config.slots << " slots, "
+			  << config.operations << " operations, write proportion "
+			  << config.write << ", stall " << config.stall_ms << " ms\r\n";
+	size_t violations{0};
+	for (const RunResult& run : runs) {
+		std::cout << "[THREADS " << run.threads << "] " << std::fixed
+				  << std::setprecision(1)
+				  << run.churn.operations / run.churn.seconds
+				  << " ops/sec, reclaimed " << run.churn.reclaimed << " of "
+				  << run.churn.retired << ", max pending "
+				  << run.churn.max_pending << "; stalled: reclaimed "
+				  << run.stall.reclaimed << " of " << run.stall.retired
+				  << ", max pending " << run.stall.max_pending << " (bound "
+				  << run.stall_bound << "), "
+				  << (run.violations ? std::to_string(run.violations) +
+										   " violations"
+									 : std::string("ok"))
+				  << "\r\n";
+		violations += run.violations;
+	}
+	return violations ? 1 : 0;
+}
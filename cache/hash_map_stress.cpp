@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrent_hash_map.hpp"
+
+// Stress test of ConcurrentHashMap. For every thread count it runs on a map
+// with few buckets (long lists, so neighbouring nodes are changed by
+// different threads all the time):
+//   - owned keys: each thread inserts, assigns, erases and finds keys only
+//     it writes, checking every result against its own model, and finds
+//     and visits keys of other threads, checking any value seen is one
+//     written for that key (a freed or reused node would not be)
+//   - contended keys: all threads insert() the same keys, then erase()
+//     them; exactly one insert and one erase of each key must succeed
+// Afterwards size() and contents must match the models. Build it with
+// -fsanitize=address to have use after free reported too.
+
+using Clock = std::chrono::steady_clock;
+
+struct MapStressConfig {
+	std::vector<int> thread_counts{1, 2, 4, 8, 16, 32};
+	// keys owned by each thread
+	size_t keys{128};
+	// map size hint, sets the bucket count
+	size_t buckets{8};
+	// operations on owned keys per thread count, split between its threads
+	size_t operations{400000};
+	// proportion of operations reading keys of other threads
+	double foreign_reads{0.3};
+	size_t contended_keys{2048};
+	uint64_t seed{1};
+};
+
+struct RunResult {
+	int threads{0};
+	size_t operations{0};
+	double seconds{0};
+	size_t violations{0};
+};
+
+std::string owned_key(int thread_id, size_t key_number) {
+	return "t" + std::to_string(thread_id) + ".k" + std::to_string(key_number);
+}
+
+// values carry their key, so a reader can tell one written for another key
+std::string value_for(const std::string& key, size_t version) {
+	return key + "=" + std::to_string(version);
+}
+
+bool is_value_of(const std::string& key, const std::string& value) {
+	return value.size() > key.size() &&
+		   value.compare(0, key.size(), key) == 0 && value[key.size()] == '=';
+}
+
+struct ThreadResult {
+	std::map<std::string, std::string> model;
+	std::vector<std::string> violations;
+	size_t operations{0};
+};
+
+void run_owned(int thread_id, int threads, const MapStressConfig& config,
+			   ConcurrentHashMap<std::string>& map, size_t operations,
+			   ThreadResult& result) {
+	std::mt19937_64 random(config.seed * 1000003 + thread_id);
+	std::uniform_int_distribution<size_t> pick_key(0, config.keys - 1);
+	std::uniform_int_distribution<int> pick_thread(0, threads - 1);
+	std::uniform_real_distribution<double> chance(0.0, 1.0);
+	std::uniform_int_distribution<int> pick_op(0, 3);
+	auto violation = [&result](const std::string& what) {
+		result.violations.push_back(what);
+	};
+
+	for (size_t i = 0; i < operations; ++i) {
+		if (chance(random) < config.foreign_reads) {
+			std::string key = owned_key(pick_thread(random), pick_key(random));
+			std::string value;
+			if (map.find(key, value) && !is_value_of(key, value)) {
+				violation("find(" + key + ") returned " + value);
+			}
+			map.visit(key, [&](const std::string& seen) {
+				if (!is_value_of(key, seen)) {
+					violation("visit(" + key + ") saw " + seen);
+				}
+			});
+			continue;
+		}
+		std::string key = owned_key(thread_id, pick_key(random));
+		auto modelled = result.model.find(key);
+		bool present = modelled != result.model.end();
+		std::string value = value_for(key, i);
+		switch (pick_op(random)) {
+			case 0:
+				if (map.insert(key, value) == present) {
+					violation("insert(" + key + ") disagrees with the model");
+				}
+				if (!present) result.model.emplace(key, value);
+				break;
+			case 1:
+				if (map.insert_or_assign(key, value) == present) {
+					violation("insert_or_assign(" + key +
+							  ") disagrees with the model");
+				}
+				result.model[key] = value;
+				break;
+			case 2:
+				if (map.erase(key) != present) {
+					violation("erase(" + key + ") disagrees with the model");
+				}
+				if (present) result.model.erase(modelled);
+				break;
+			default: {
+				std::string found;
+				bool is_found = map.find(key, found);
+				if (is_found != present ||
+					(present && found != modelled->second)) {
+					violation("find(" + key + ") returned " +
+							  (is_found ? found : std::string("nothing")) +
+							  ", expected " +
+							  (present ? modelled->second
+									   : std::string("nothing")));
+				}
+				if (map.contains(key) != present) {
+					violation("contains(" + key +
+							  ") disagrees with the model");
+				}
+			}
+		}
+	}
+	result.operations = operations;
+}
+
+// all threads insert, then erase all contended keys. returns false if a key
+// wasn't inserted or erased exactly once
+bool run_contended(int threads, const MapStressConfig& config,
+				   ConcurrentHashMap<std::string>& map,
+				   std::vector<std::string>& violations) {
+	std::vector<std::atomic<int>> inserts(config.contended_keys);
+	std::vector<std::atomic<int>> erases(config.contended_keys);
+	auto key_of = [](size_t key_number) {
+		return "shared.k" + std::to_string(key_number);
+	};
+	auto run_all = [threads](auto body) {
+		std::vector<std::thread> workers;
+		for (int i = 0; i < threads; ++i) {
+			workers.emplace_back(body, i);
+		}
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	};
+	// each thread walks the keys from its own offset
+	run_all([&](int thread_id) {
+		for (size_t n = 0; n < config.contended_keys; ++n) {
+			size_t k = (n + thread_id * 7919) % config.contended_keys;
+			if (map.insert(key_of(k), value_for(key_of(k), thread_id))) {
+				inserts[k].fetch_add(1);
+			}
+		}
+	});
+	run_all([&](int thread_id) {
+		for (size_t n = 0; n < config.contended_keys; ++n) {
+			size_t k = (n + thread_id * 7919) % config.contended_keys;
+			if (map.erase(key_of(k))) erases[k].fetch_add(1);
+		}
+	});
+	size_t before = violations.size();
+	for (size_t k = 0; k < config.contended_keys; ++k) {
+		if (inserts[k].load() != 1 || erases[k].load() != 1) {
+			violations.push_back(key_of(k) + " inserted " +
+								 std::to_string(inserts[k].load()) +
+								 " times, erased " +
+								 std::to_string(erases[k].load()) + " times");
+		}
+		if (map.contains(key_of(k))) {
+			violations.push_back(key_of(k) + " still present after erase");
+		}
+	}
+	return violations.size() == before;
+}
+
+RunResult run_stress(int threads, const MapStressConfig& config) {
+	RunResult run;
+	run.threads = threads;
+	ConcurrentHashMap<std::string> map(config.buckets);
+	std::vector<ThreadResult> results(threads);
+
+	std::vector<std::thread> workers;
+	auto start = Clock::now();
+	for (int i = 0; i < threads; ++i) {
+		size_t operations =
+			config.operations / threads +
+			(static_cast<size_t>(i) < config.operations % threads);
+		workers.emplace_back(run_owned, i, threads, std::cref(config),
+							 std::ref(map), operations, std::ref(results[i]));
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+	run.seconds = elapsed.count();
+
+	std::vector<std::string> violations;
+	size_t expected_size = 0;
+	for (int i = 0; i < threads; ++i) {
+		const ThreadResult& result = results[i];
+		run.operations += result.operations;
+		violations.insert(violations.end(), result.violations.begin(),
+						  result.violations.end());
+		expected_size += result.model.size();
+		for (size_t k = 0; k < config.keys; ++k) {
+			std::string key = owned_key(i, k);
+			auto modelled = result.model.find(key);
+			std::string found;
+			bool is_found = map.find(key, found);
+			if (is_found != (modelled != result.model.end()) ||
+				(is_found && found != modelled->second)) {
+				violations.push_back("final " + key +
+									 " disagrees with the model");
+			}
+		}
+	}
+	if (map.size() != expected_size) {
+		violations.push_back("size() " + std::to_string(map.size()) +
+							 ", expected " + std::to_string(expected_size));
+	}
+	run_contended(threads, config, map, violations);
+	if (map.size() != expected_size) {
+		violations.push_back("size() " + std::to_string(map.size()) +
+							 " after contended keys, expected " +
+							 std::to_string(expected_size));
+	}
+
+	run.violations = violations.size();
+	constexpr size_t kMaxPrinted = 10;
+	for (size_t i = 0; i < violations.size() && i < kMaxPrinted; ++i) {
+		std::cout << "[VIOLATION] " << threads << " threads: "
+				  << violations[i] << "\r\n";
+	}
+	if (violations.size() > kMaxPrinted) {
+		std::cout << "[VIOLATION] " << threads << " threads: ... "
+				  << violations.size() - kMaxPrinted << " more\r\n";
+	}
+	return run;
+}
+
+void print_usage(const char* program) {
+	std::cerr
+		<< "Usage: " << program << " [options]\r\n"
+		<< "  --threads <n,n,...>       thread counts to run "
+		   "(1,2,4,8,16,32)\r\n"
+		<< "  --operations <n>          operations per thread count "
+		   "(400000)\r\n"
+		<< "  --keys <n>                keys owned by each thread (128)\r\n"
+		<< "  --buckets <n>             map size hint, sets the bucket "
+		   "count (8)\r\n"
+		<< "  --foreign-reads <proportion>\r\n"
+		<< "                            reads of other threads' keys "
+		   "(0.3)\r\n"
+		<< "  --contended-keys <n>      keys all threads insert and erase "
+		   "(2048)\r\n"
+		<< "  --seed <n>                operation generator seed (1)\r\n";
+}
+
+// returns false on invalid arguments
+bool parse_args(int argc, char* argv[], MapStressConfig& config) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		std::string value = argv[++i];
+		if (arg == "--threads") {
+			config.thread_counts.clear();
+			std::istringstream list(value);
+			std::string count;
+			while (std::getline(list, count, ',')) {
+				config.thread_counts.push_back(std::stoi(count));
+			}
+		} else if (arg == "--operations") {
+			config.operations = std::stoull(value);
+		} else if (arg == "--keys") {
+			config.keys = std::stoull(value);
+		} else if (arg == "--buckets") {
+			config.buckets = std::stoull(value);
+		} else if (arg == "--foreign-reads") {
+			config.foreign_reads = std::stod(value);
+		} else if (arg == "--contended-keys") {
+			config.contended_keys = std::stoull(value);
+		} else if (arg == "--seed") {
+			config.seed = std::stoull(value);
+		} else {
+			return false;
+		}
+	}
+	bool threads_ok = !config.thread_counts.empty() &&
+					  std::all_of(config.thread_counts.begin(),
+								  config.thread_counts.end(),
+								  [](int count) { return count > 0; });
+	return threads_ok && config.keys > 0;
+}
+
+int main(int argc, char* argv[]) {
+	MapStressConfig config;
+	try {
+		if (!parse_args(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Error: Invalid number as an argument!\r\n";
+		return 1;
+	}
+
+	std::vector<RunResult> runs;
+	for (int threads : config.thread_counts) {
+		runs.push_back(run_stress(threads, config));
+	}
+
+	std::cout << "seed " << config.seed << ", " << config.keys
+			  << " keys per thread, " << config.buckets << " buckets, "
+			  << config.operations << " operations, " << config.contended_keys
+			  << " contended keys\r\n";
+	size_t violations{0};
+	double base_rate = runs[0].operations / runs[0].seconds;
+	for (const RunResult& run : runs) {
+		double rate = run.operations / run.seconds;
+		std::cout << "[THREADS " << run.threads << "] " << std::fixed
+				  << std::setprecision(1) << rate << " ops/sec, speedup "
+				  << std::setprecision(2) << rate / base_rate << ", "
+				  << (run.violations ? std::to_string(run.violations) +
+										   " violations"
+									 : std::string("ok"))
+				  << "\r\n";
+		violations += run.violations;
+	}
+	return violations ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// 64 bit wyhash (final version 4 with its default secret) of key bytes: a
+// couple of 64x64->128 bit multiplications per 16 bytes, much faster than
+// std::hash<std::string> on long keys and with all 64 output bits well
+// mixed, so any of them can pick a shard, stripe or bucket.
+// Not cryptographic, and reads bytes in native order: don't persist it
+// across hosts.
+inline uint64_t key_hash(std::string_view key, uint64_t seed = 0) {
+	constexpr uint64_t kSecret[4] = {0x2d358dccaa6c78a5ULL,
+									 0x8bb84b93962eacc9ULL,
+									 0x4b33a62ed433d4a3ULL,
+									 0x4d5a2da51de1aa47ULL};
+	// 128 bit product of a and b folded to 64 bits
+	auto mum = [](uint64_t a, uint64_t b) {
+		__uint128_t r = static_cast<__uint128_t>(a) * b;
+		return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+	};
+	auto read8 = [](const uint8_t* p) {
+		uint64_t v;
+		std::memcpy(&v, p, 8);
+		return v;
+	};
+	auto read4 = [](const uint8_t* p) {
+		uint32_t v;
+		std::memcpy(&v, p, 4);
+		return static_cast<uint64_t>(v);
+	};
+
+	const uint8_t* p = reinterpret_cast<const uint8_t*>(key.data());
+	size_t length = key.size();
+	seed ^= mum(seed ^ kSecret[0], kSecret[1]);
+	uint64_t a{0}, b{0};
+	if (length <= 16) {
+		if (length >= 4) {
+			size_t middle = (length >> 3) << 2;
+			a = (read4(p) << 32) | read4(p + middle);
+			b = (read4(p + length - 4) << 32) | read4(p + length - 4 - middle);
+		} else if (length > 0) {
+			a = (static_cast<uint64_t>(p[0]) << 16) |
+				(static_cast<uint64_t>(p[length >> 1]) << 8) | p[length - 1];
+		}
+	} else {
+		size_t left = length;
+		if (left > 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+			do {
+				seed = mum(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+				seed1 = mum(read8(p + 16) ^ kSecret[2], read8(p + 24) ^ seed1);
+				seed2 = mum(read8(p + 32) ^ kSecret[3], read8(p + 40) ^ seed2);
+				p += 48;
+				left -= 48;
+			} while (left > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (left > 16) {
+			seed = mum(read8(p) ^ kSecret[1], read8(p + 8) ^ seed);
+			p += 16;
+			left -= 16;
+		}
+		a = read8(p + left - 16);
+		b = read8(p + left - 8);
+	}
+	__uint128_t r = static_cast<__uint128_t>(a ^ kSecret[1]) * (b ^ seed);
+	return mum(static_cast<uint64_t>(r) ^ kSecret[0] ^ length,
+			   static_cast<uint64_t>(r >> 64) ^ kSecret[1]);
+}
+
+// A key with its key_hash() computed once, so every hash based structure on
+// the path of one operation (transaction maps, near cache, version stripes,
+// bloom filter, cache, file index, partition choice) reuses it instead of
+// hashing the key again. Converts implicitly from std::string (hashing it).
+struct HashedKey {
+	std::string key;
+	uint64_t hash;
+
+	HashedKey(std::string key_) : key(std::move(key_)), hash(key_hash(key)) {}
+
+	bool operator==(const HashedKey& other) const {
+		return hash == other.hash && key == other.key;
+	}
+	bool operator!=(const HashedKey& other) const { return !(*this == other); }
+};
+
+// hasher of unordered containers keyed by HashedKey
+struct HashedKeyHash {
+	size_t operator()(const HashedKey& key) const noexcept { return key.hash; }
+};
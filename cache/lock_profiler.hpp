@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+// Lock contention profiler, compiled in with -DDB_LOCK_PROFILING.
+// DB_LOCK_GUARD(name, mutex) is a std::lock_guard, or with profiling on a
+// guard recording for its call site how often the lock was taken and
+// found busy, how long threads waited for it and how long they held it.
+// print_lock_report() lists the worst call sites by total wait time.
+
+// Statistics of one DB_LOCK_GUARD call site, registered on first use
+struct LockSiteStats {
+	const char* lock_name;
+	const char* function;
+	const char* file;
+	int line;
+	std::atomic<uint64_t> acquisitions{0};
+	// acquisitions that found the lock taken and had to wait
+	std::atomic<uint64_t> contended{0};
+	std::atomic<uint64_t> wait_ns{0};
+	std::atomic<uint64_t> max_wait_ns{0};
+	std::atomic<uint64_t> hold_ns{0};
+	std::atomic<uint64_t> max_hold_ns{0};
+
+	LockSiteStats(const char* lock_name, const char* function,
+				  const char* file, int line)
+		: lock_name(lock_name), function(function), file(file), line(line) {
+		std::lock_guard<std::mutex> lock(registry_mutex());
+		registry().push_back(this);
+	}
+
+	// all call sites seen so far (sites are function statics, never freed)
+	static std::vector<LockSiteStats*>& registry() {
+		static std::vector<LockSiteStats*> sites;
+		return sites;
+	}
+	static std::mutex& registry_mutex() {
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static void update_max(std::atomic<uint64_t>& max, uint64_t value) {
+		uint64_t current = max.load(std::memory_order_relaxed);
+		while (value > current &&
+			   !max.compare_exchange_weak(current, value,
+										  std::memory_order_relaxed)) {
+		}
+	}
+};
+
+// lock_guard that records wait and hold times of `site`
+template <typename Mutex>
+class ProfiledLockGuard {
+   private:
+	Mutex& m_mutex;
+	LockSiteStats& m_site;
+	std::chrono::steady_clock::time_point m_locked_at;
+
+	static uint64_t since_ns(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now() - start)
+			.count();
+	}
+
+   public:
+	ProfiledLockGuard(Mutex& mutex, LockSiteStats& site)
+		: m_mutex(mutex), m_site(site) {
+		m_site.acquisitions.fetch_add(1, std::memory_order_relaxed);
+		if (!m_mutex.try_lock()) {
+			auto start = std::chrono::steady_clock::now();
+			m_mutex.lock();
+			uint64_t waited = since_ns(start);
+			m_site.contended.fetch_add(1, std::memory_order_relaxed);
+			m_site.wait_ns.fetch_add(waited, std::memory_order_relaxed);
+			LockSiteStats::update_max(m_site.max_wait_ns, waited);
+		}
+		m_locked_at = std::chrono::steady_clock::now();
+	}
+	ProfiledLockGuard(const ProfiledLockGuard&) = delete;
+	ProfiledLockGuard& operator=(const ProfiledLockGuard&) = delete;
+
+	~ProfiledLockGuard() {
+		uint64_t held = since_ns(m_locked_at);
+		m_mutex.unlock();
+		m_site.hold_ns.fetch_add(held, std::memory_order_relaxed);
+		LockSiteStats::update_max(m_site.max_hold_ns, held);
+	}
+};
+
+#ifdef DB_LOCK_PROFILING
+#define DB_LOCK_GUARD(name, mutex)                                        \
+	static LockSiteStats name##_site(#mutex, __func__, __FILE__, __LINE__); \
+	ProfiledLockGuard<std::decay_t<decltype(mutex)>> name(mutex, name##_site)
+#else
+#define DB_LOCK_GUARD(name, mutex) \
+	std::lock_guard<std::decay_t<decltype(mutex)>> name(mutex)
+#endif
+
+// Prints up to `worst` call sites with the most total wait time, nothing
+// with profiling off
+inline void print_lock_report(std::ostream& out, size_t worst = 10) {
+#ifndef DB_LOCK_PROFILING
+	(void)out;
+	(void)worst;
+#else
+	std::vector<LockSiteStats*> sites;
+	{
+		std::lock_guard<std::mutex> lock(LockSiteStats::registry_mutex());
+		sites = LockSiteStats::registry();
+	}
+	std::sort(sites.begin(), sites.end(), [](const auto* a, const auto* b) {
+		return a->wait_ns.load() > b->wait_ns.load();
+	});
+	out << "lock call sites by total wait time:\r\n";
+	auto flags = out.flags();
+	out << std::fixed << std::setprecision(3);
+	for (size_t i = 0; i < std::min(worst, sites.size()); ++i) {
+		const LockSiteStats& s = *sites[i];
+		uint64_t acquisitions = s.acquisitions.load();
+		uint64_t contended = s.contended.load();
+		out << i + 1 << ". " << s.lock_name << " in " << s.function << " ("
+			<< s.file << ":" << s.line << ")\r\n"
+			<< "   acquisitions " << acquisitions << ", contended "
+			<< contended << " ("
+			<< (acquisitions ? 100.0 * contended / acquisitions : 0)
+			<< "%)\r\n"
+			<< "   wait total " << s.wait_ns.load() / 1e6 << " ms, avg "
+			<< (contended ? s.wait_ns.load() / 1e3 / contended : 0)
+			<< " us per contended, max " << s.max_wait_ns.load() / 1e3
+			<< " us\r\n"
+			<< "   hold total " << s.hold_ns.load() / 1e6 << " ms, avg "
+			<< (acquisitions ? s.hold_ns.load() / 1e3 / acquisitions : 0)
+			<< " us, max " << s.max_hold_ns.load() / 1e3 << " us\r\n";
+	}
+	out.flags(flags);
+#endif
+}
@@ -0,0 +1,378 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// adds to a counter only its owner thread writes: plain load + store instead
+// of a locked read-modify-write, readers on other threads still see whole
+// values
+inline void counter_add(std::atomic<uint64_t>& counter, uint64_t value = 1) {
+	counter.store(counter.load(std::memory_order_relaxed) + value,
+				  std::memory_order_relaxed);
+}
+
+// Aggregated (read side) copy of LatencyHistogram counts
+struct HistogramSnapshot {
+	std::vector<uint64_t> counts;
+	uint64_t total{0};
+	uint64_t sum{0};
+	uint64_t max{0};
+
+	// value at percentile `p` (0-100), lower bound of its bucket
+	uint64_t percentile(double p) const;
+	double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+	// adds counts of `other` (of another histogram)
+	void add(const HistogramSnapshot& other);
+	std::string to_json() const;
+};
+
+// Log-linear histogram of latencies in nanoseconds, the HdrHistogram layout:
+// values are grouped by power of two and each group is split into
+// kSubBuckets linear buckets, giving ~3% relative precision over the whole
+// uint64_t range in fixed memory. Written by one thread (counter_add),
+// read by any.
+class LatencyHistogram {
+   public:
+	static constexpr int kSubBucketBits = 5;
+	static constexpr uint64_t kSubBuckets = 1ULL << kSubBucketBits;
+	static constexpr size_t kBuckets = (65 - kSubBucketBits) * kSubBuckets;
+
+	static size_t bucket_index(uint64_t value) {
+		if (value < kSubBuckets) return value;
+		int exponent = 63 - __builtin_clzll(value) - kSubBucketBits;
+		return (exponent + 1) * kSubBuckets +
+			   ((value >> exponent) - kSubBuckets);
+	}
+	// smallest value that falls into bucket `index`
+	static uint64_t bucket_value(size_t index) {
+		if (index < kSubBuckets) return index;
+		int exponent = static_cast<int>(index / kSubBuckets) - 1;
+		return (kSubBuckets + index % kSubBuckets) << exponent;
+	}
+
+	void record(uint64_t value) {
+		counter_add(m_counts[bucket_index(value)]);
+		counter_add(m_sum, value);
+		if (value > m_max.load(std::memory_order_relaxed)) {
+			m_max.store(value, std::memory_order_relaxed);
+		}
+	}
+
+	// adds this histogram's counts to `snapshot`
+	void merge_into(HistogramSnapshot& snapshot) const {
+		snapshot.counts.resize(kBuckets);
+		for (size_t i = 0; i < kBuckets; ++i) {
+			uint64_t count = m_counts[i].load(std::memory_order_relaxed);
+			snapshot.counts[i] += count;
+			snapshot.total += count;
+		}
+		snapshot.sum += m_sum.load(std::memory_order_relaxed);
+		snapshot.max =
+			std::max(snapshot.max, m_max.load(std::memory_order_relaxed));
+	}
+
+   private:
+	std::array<std::atomic<uint64_t>, kBuckets> m_counts{};
+	std::atomic<uint64_t> m_sum{0};
+	std::atomic<uint64_t> m_max{0};
+};
+
+inline uint64_t HistogramSnapshot::percentile(double p) const {
+	if (total == 0) return 0;
+	uint64_t rank =
+		std::max<uint64_t>(1, static_cast<uint64_t>(p / 100 * total));
+	uint64_t seen{0};
+	for (size_t i = 0; i < counts.size(); ++i) {
+		seen += counts[i];
+		if (seen >= rank) return LatencyHistogram::bucket_value(i);
+	}
+	return max;
+}
+
+inline void HistogramSnapshot::add(const HistogramSnapshot& other) {
+	counts.resize(std::max(counts.size(), other.counts.size()));
+	for (size_t i = 0; i < other.counts.size(); ++i) {
+		counts[i] += other.counts[i];
+	}
+	total += other.total;
+	sum += other.sum;
+	max = std::max(max, other.max);
+}
+
+inline std::string HistogramSnapshot::to_json() const {
+	std::ostringstream out;
+	out << "{\"count\": " << total << ", \"mean\": " << mean()
+		<< ", \"p50\": " << percentile(50) << ", \"p90\": " << percentile(90)
+		<< ", \"p99\": " << percentile(99) << ", \"p999\": " << percentile(99.9)
+		<< ", \"max\": " << max << "}";
+	return out.str();
+}
+
+// Counters and histograms of a single thread, cache line aligned so threads
+// don't share lines
+struct alignas(64) ThreadMetrics {
+	std::thread::id owner;
+	// get_key() answered from the transaction's own uncommited changes
+	std::atomic<uint64_t> transaction_reads{0};
+	// get_key() of a key the transaction already read, answered from its
+	// read set
+	std::atomic<uint64_t> repeat_reads{0};
+	// get_key() answered by the thread's near cache
+	std::atomic<uint64_t> near_cache_hits{0};
+	// get_key() answered by the bloom filter (key is not in DB)
+	std::atomic<uint64_t> bloom_negatives{0};
+	// get_key() that had to read the file (cache hits are counted by the
+	// cache itself, under the lock the hit takes anyway)
+	std::atomic<uint64_t> cache_misses{0};
+	// keys queued by prefetch(), and get_key() cache misses that waited for
+	// a prefetch in flight instead of reading the file
+	std::atomic<uint64_t> prefetches{0};
+	std::atomic<uint64_t> prefetch_joins{0};
+	std::atomic<uint64_t> commits{0};
+	// commits whose writes were applied by another committer's pass (flat
+	// combining, see commit_transaction())
+	std::atomic<uint64_t> combined_commits{0};
+	std::atomic<uint64_t> aborts{0};
+	// keys dropped from the caches because another process committed them,
+	// and times the whole cache was dropped (see change notifications)
+	std::atomic<uint64_t> external_invalidations{0};
+	std::atomic<uint64_t> external_full_invalidations{0};
+	// time commits spent waiting for the DB file lock
+	std::atomic<uint64_t> commit_lock_wait_ns{0};
+	// get_key() latency, sampled (every kGetSampleEvery-th call)
+	LatencyHistogram get_latency;
+	LatencyHistogram commit_latency;
+};
+
+// Value compression of a cache (see Cache::set_compression()). Byte counts
+// are of the values currently cached, times are totals so far
+struct CacheCompressionStats {
+	uint64_t compressed_values{0};
+	uint64_t raw_bytes{0};
+	uint64_t stored_bytes{0};
+	uint64_t compressions{0};
+	uint64_t compress_ns{0};
+	uint64_t decompressions{0};
+	uint64_t decompress_ns{0};
+
+	void add(const CacheCompressionStats& other) {
+		compressed_values += other.compressed_values;
+		raw_bytes += other.raw_bytes;
+		stored_bytes += other.stored_bytes;
+		compressions += other.compressions;
+		compress_ns += other.compress_ns;
+		decompressions += other.decompressions;
+		decompress_ns += other.decompress_ns;
+	}
+
+	// raw / stored size of cached values (1 if there are none)
+	double ratio() const {
+		return stored_bytes ? static_cast<double>(raw_bytes) / stored_bytes
+							: 1;
+	}
+
+	std::string to_json() const {
+		std::ostringstream out;
+		out << "{\"compressed_values\": " << compressed_values
+			<< ", \"raw_bytes\": " << raw_bytes
+			<< ", \"stored_bytes\": " << stored_bytes
+			<< ", \"ratio\": " << ratio()
+			<< ", \"compressions\": " << compressions
+			<< ", \"compress_ns\": " << compress_ns
+			<< ", \"decompressions\": " << decompressions
+			<< ", \"decompress_ns\": " << decompress_ns << "}";
+		return out.str();
+	}
+};
+
+// Point in time view of all metrics of a database
+struct MetricsSnapshot {
+	uint64_t gets{0};
+	uint64_t transaction_reads{0};
+	uint64_t repeat_reads{0};
+	uint64_t near_cache_hits{0};
+	uint64_t bloom_negatives{0};
+	uint64_t cache_hits{0};
+	uint64_t cache_misses{0};
+	uint64_t cache_evictions{0};
+	uint64_t cache_size{0};
+	uint64_t prefetches{0};
+	uint64_t prefetch_joins{0};
+	CacheCompressionStats cache_compression;
+	// cache hits (included in cache_hits) answered by the disk tier and
+	// values it holds
+	uint64_t second_tier_hits{0};
+	uint64_t second_tier_size{0};
+	uint64_t commits{0};
+	uint64_t combined_commits{0};
+	uint64_t aborts{0};
+	uint64_t external_invalidations{0};
+	uint64_t external_full_invalidations{0};
+	uint64_t commit_lock_wait_ns{0};
+	// keys in the DB file index and time building it took at open
+	uint64_t index_keys{0};
+	uint64_t index_build_ns{0};
+	HistogramSnapshot get_latency;
+	HistogramSnapshot commit_latency;
+
+	// adds metrics of `other` (of another database)
+	void add(const MetricsSnapshot& other) {
+		gets += other.gets;
+		transaction_reads += other.transaction_reads;
+		repeat_reads += other.repeat_reads;
+		near_cache_hits += other.near_cache_hits;
+		bloom_negatives += other.bloom_negatives;
+		cache_hits += other.cache_hits;
+		cache_misses += other.cache_misses;
+		cache_evictions += other.cache_evictions;
+		cache_size += other.cache_size;
+		prefetches += other.prefetches;
+		prefetch_joins += other.prefetch_joins;
+		cache_compression.add(other.cache_compression);
+		second_tier_hits += other.second_tier_hits;
+		second_tier_size += other.second_tier_size;
+		commits += other.commits;
+		combined_commits += other.combined_commits;
+		aborts += other.aborts;
+		external_invalidations += other.external_invalidations;
+		external_full_invalidations += other.external_full_invalidations;
+		commit_lock_wait_ns += other.commit_lock_wait_ns;
+		index_keys += other.index_keys;
+		index_build_ns += other.index_build_ns;
+		get_latency.add(other.get_latency);
+		commit_latency.add(other.commit_latency);
+	}
+
+	// fraction of cache lookups that hit (0 if there were none)
+	double cache_hit_ratio() const {
+		uint64_t lookups = cache_hits + cache_misses;
+		return lookups ? static_cast<double>(cache_hits) / lookups : 0;
+	}
+
+	std::string to_json() const {
+		std::ostringstream out;
+		out << "{\"gets\": " << gets
+			<< ", \"transaction_reads\": " << transaction_reads
+			<< ", \"repeat_reads\": " << repeat_reads
+			<< ", \"near_cache_hits\": " << near_cache_hits
+			<< ", \"bloom_negatives\": " << bloom_negatives
+			<< ", \"cache_hits\": " << cache_hits
+			<< ", \"cache_misses\": " << cache_misses
+			<< ", \"cache_hit_ratio\": " << cache_hit_ratio()
+			<< ", \"cache_evictions\": " << cache_evictions
+			<< ", \"cache_size\": " << cache_size
+			<< ", \"prefetches\": " << prefetches
+			<< ", \"prefetch_joins\": " << prefetch_joins
+			<< ", \"cache_compression\": " << cache_compression.to_json()
+			<< ", \"second_tier_hits\": " << second_tier_hits
+			<< ", \"second_tier_size\": " << second_tier_size
+			<< ", \"commits\": " << commits
+			<< ", \"combined_commits\": " << combined_commits
+			<< ", \"aborts\": " << aborts
+			<< ", \"external_invalidations\": " << external_invalidations
+			<< ", \"external_full_invalidations\": "
+			<< external_full_invalidations
+			<< ", \"commit_lock_wait_ns\": " << commit_lock_wait_ns
+			<< ", \"index_keys\": " << index_keys
+			<< ", \"index_build_ns\": " << index_build_ns
+			<< ", \"get_latency_ns\": " << get_latency.to_json()
+			<< ", \"commit_latency_ns\": " << commit_latency.to_json() << "}";
+		return out.str();
+	}
+};
+
+// Registry of per-thread metrics of one database. Threads write only their
+// own ThreadMetrics (found through a thread_local slot per database, no
+// locking after the first call), snapshot() sums them all up. Blocks of
+// exited threads are kept so their counts aren't lost.
+// The cache hit path touches none of it except on sampled calls.
+class DbMetrics {
+   public:
+	// get_key() latency is measured on one call out of this many to keep
+	// two clock reads off most hits
+	static constexpr uint32_t kGetSampleEvery = 64;
+	// thread_local slots local() caches blocks in (DBs with ids this far
+	// apart share one)
+	static constexpr size_t kLocalSlots = 64;
+
+	DbMetrics() : m_id(s_next_id.fetch_add(1) + 1) {}
+	DbMetrics(const DbMetrics&) = delete;
+	DbMetrics& operator=(const DbMetrics&) = delete;
+
+	// metrics block of the calling thread
+	ThreadMetrics& local() {
+		// slots are picked by DB id, so a thread using several DBs in turn
+		// (like partitions) doesn't keep evicting one for another
+		struct Slot {
+			uint64_t owner_id{0};
+			ThreadMetrics* metrics{nullptr};
+		};
+		thread_local Slot t_slots[kLocalSlots];
+		Slot& slot = t_slots[m_id % kLocalSlots];
+		if (slot.owner_id == m_id) return *slot.metrics;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto id = std::this_thread::get_id();
+		auto it = std::find_if(m_threads.begin(), m_threads.end(),
+							   [id](const auto& m) { return m->owner == id; });
+		if (it == m_threads.end()) {
+			m_threads.push_back(std::make_unique<ThreadMetrics>());
+			m_threads.back()->owner = id;
+			it = std::prev(m_threads.end());
+		}
+		slot.owner_id = m_id;
+		slot.metrics = it->get();
+		return *slot.metrics;
+	}
+
+	// sums counters and histograms of all threads (cache fields and gets,
+	// which include cache hits, are left for the owner to fill in)
+	MetricsSnapshot snapshot() {
+		MetricsSnapshot result;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (const auto& m : m_threads) {
+			result.transaction_reads +=
+				m->transaction_reads.load(std::memory_order_relaxed);
+			result.repeat_reads +=
+				m->repeat_reads.load(std::memory_order_relaxed);
+			result.near_cache_hits +=
+				m->near_cache_hits.load(std::memory_order_relaxed);
+			result.bloom_negatives +=
+				m->bloom_negatives.load(std::memory_order_relaxed);
+			result.cache_misses +=
+				m->cache_misses.load(std::memory_order_relaxed);
+			result.prefetches += m->prefetches.load(std::memory_order_relaxed);
+			result.prefetch_joins +=
+				m->prefetch_joins.load(std::memory_order_relaxed);
+			result.commits += m->commits.load(std::memory_order_relaxed);
+			result.combined_commits +=
+				m->combined_commits.load(std::memory_order_relaxed);
+			result.aborts += m->aborts.load(std::memory_order_relaxed);
+			result.external_invalidations +=
+				m->external_invalidations.load(std::memory_order_relaxed);
+			result.external_full_invalidations +=
+				m->external_full_invalidations.load(std::memory_order_relaxed);
+			result.commit_lock_wait_ns +=
+				m->commit_lock_wait_ns.load(std::memory_order_relaxed);
+			m->get_latency.merge_into(result.get_latency);
+			m->commit_latency.merge_into(result.commit_latency);
+		}
+		return result;
+	}
+
+   private:
+	// unique per instance, so a thread_local pointer left from a destroyed
+	// database at the same address is never reused
+	inline static std::atomic<uint64_t> s_next_id{0};
+	const uint64_t m_id;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadMetrics>> m_threads;
+};
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "db_cache.hpp"
+#include "metrics.hpp"
+
+// Hash-partitioned storage: keys are spread by key_hash() over N
+// CachedFileDatabase partitions, DB files "<file>.0" ... "<file>.<N-1>", each
+// with its own file lock and cache shard, so commits on keys of different
+// partitions neither wait for each other nor rewrite the same file.
+// A transaction keeps its uncommited changes itself and on commit writes
+// every partition it touched as one transaction of that partition. Only
+// transactions spanning partitions are coordinated: they take the commit
+// locks of their partitions exclusively, in partition order (so two of them
+// can't deadlock), and write all of their parts before releasing any.
+// Reads from a partition take its commit lock shared, so no one sees a part
+// of such a commit before the rest is written. Single-partition commits take
+// no commit lock, the partition commit is atomic by itself.
+// Partitions are CachedFileDatabases, whose transaction state is per
+// thread: a commit fails while the thread is in a transaction of one.
+class PartitionedDatabase : public i_db {
+   private:
+	struct Partition {
+		std::unique_ptr<CachedFileDatabase> db;
+		std::shared_mutex commit_mutex;
+	};
+	// uncommited change of a key, nullopt - delete
+	using Change = std::pair<const HashedKey, std::optional<std::string>>;
+
+	std::vector<std::unique_ptr<Partition>> m_partitions;
+	std::atomic<uint64_t> m_multi_partition_commits{0};
+
+	// Thread-locals, as in CachedFileDatabase: uncommited changes and
+	// committed values the transaction has read ("" - no key)
+	inline thread_local static bool ts_transaction_active = false;
+	inline thread_local static bool ts_transaction_read_only = false;
+	inline thread_local static std::unordered_map<
+		HashedKey, std::optional<std::string>, HashedKeyHash>
+		ts_transaction_changes;
+	inline thread_local static std::unordered_map<HashedKey, std::string,
+												  HashedKeyHash>
+		ts_transaction_reads;
+
+	// picks the partition by the high bits of the hash (scaled to the
+	// partition count), so the low ones partitions use for their own
+	// stripes and slots stay spread within a partition
+	size_t partition_index(const HashedKey& key) const {
+		return static_cast<size_t>(
+			(static_cast<__uint128_t>(key.hash) * m_partitions.size()) >> 64);
+	}
+
+	// committed value of a key from the transaction's read set, or from its
+	// partition (then remembered in the read set)
+	std::string lookup_committed_key(const HashedKey& key) {
+		auto read = ts_transaction_reads.find(key);
+		if (read != ts_transaction_reads.end()) return read->second;
+		Partition& partition = *m_partitions[partition_index(key)];
+		std::string value;
+		{
+			std::shared_lock<std::shared_mutex> lock(partition.commit_mutex);
+			value = partition.db->read_committed(key);
+		}
+		ts_transaction_reads.emplace(key, value);
+		return value;
+	}
+
+	std::string lookup_key(const HashedKey& key) {
+		auto change = ts_transaction_changes.find(key);
+		if (change != ts_transaction_changes.end()) {
+			return change->second.value_or("");
+		}
+		return lookup_committed_key(key);
+	}
+
+	// writes `changes` to `partition` as one of its transactions
+	// returns false if the thread is in a CachedFileDatabase transaction
+	// already (their state is shared by all instances, the changes would
+	// join it), nothing is written then, or if the partition commit fails
+	static bool partition_commit(Partition& partition,
+								 const std::vector<const Change*>& changes) {
+		if (!partition.db->begin_transaction()) return false;
+		for (const Change* change : changes) {
+			if (change->second) {
+				partition.db->put_key(change->first, *change->second);
+			} else {
+				partition.db->erase_key(change->first);
+			}
+		}
+		return partition.db->commit_transaction();
+	}
+
+	bool is_writable() const {
+		return ts_transaction_active && !ts_transaction_read_only;
+	}
+
+   public:
+	// `partitions` DB files "<file>.<i>" (created if missing), with caches
+	// of `cache_size` / `partitions` entries each. `format` is used for new
+	// (empty) files
+	PartitionedDatabase(const std::string& file, size_t partitions,
+						int cache_size = 0, DbFormat format = DbFormat::text) {
+		partitions = std::max<size_t>(partitions, 1);
+		int shard_size = 0;
+		if (cache_size > 0) {
+			shard_size = std::max(
+				1, cache_size / static_cast<int>(partitions));
+		}
+		for (size_t i = 0; i < partitions; ++i) {
+			std::string path = partition_path(file, i);
+			// CachedFileDatabase can't read (nor rewrite) a missing file
+			std::ofstream(path, std::ios::app);
+			auto partition = std::make_unique<Partition>();
+			partition->db =
+				std::make_unique<CachedFileDatabase>(path, shard_size, format);
+			m_partitions.push_back(std::move(partition));
+		}
+	}
+
+	// DB file of partition `index` of a partitioned database in `file`
+	static std::string partition_path(const std::string& file, size_t index) {
+		return file + "." + std::to_string(index);
+	}
+
+	size_t partition_count() const { return m_partitions.size(); }
+
+	// partition `index`, to configure (caches, notifications, ...) or
+	// inspect. transactions must go through the PartitionedDatabase
+	CachedFileDatabase& partition(size_t index) {
+		return *m_partitions[index]->db;
+	}
+
+	// begins new DB transaction
+	// returns false if is already in a transaction
+	virtual bool begin_transaction() override {
+		if (ts_transaction_active) return false;
+		// changes and the read set are always left empty by commit / abort
+		ts_transaction_active = true;
+		return true;
+	}
+
+	// begins new read-only DB transaction (see
+	// CachedFileDatabase::begin_read_only()), writes are refused
+	// returns false if is already in a transaction
+	bool begin_read_only() {
+		if (!begin_transaction()) return false;
+		ts_transaction_read_only = true;
+		return true;
+	}
+
+	// returns false if no transaction is active
+	// otherwise writes changes of every partition the transaction touched
+	// (coordinated if there are several, see PartitionedDatabase) and
+	// returns true.
+	// if a partition commit fails (see partition_commit()) the transaction
+	// is rolled back and false is returned. parts of partitions written
+	// before a failing one stay written
+	virtual bool commit_transaction() override {
+		if (!ts_transaction_active) return false;
+		bool committed = true;
+		if (!ts_transaction_changes.empty()) {
+			// changes by partition, in partition order
+			std::map<size_t, std::vector<const Change*>> parts;
+			for (const Change& change : ts_transaction_changes) {
+				parts[partition_index(change.first)].push_back(&change);
+			}
+			if (parts.size() == 1) {
+				const auto& [index, changes] = *parts.begin();
+				committed = partition_commit(*m_partitions[index], changes);
+			} else {
+				std::vector<std::unique_lock<std::shared_mutex>> locks;
+				for (const auto& part : parts) {
+					locks.emplace_back(m_partitions[part.first]->commit_mutex);
+				}
+				for (const auto& [index, changes] : parts) {
+					committed = partition_commit(*m_partitions[index], changes);
+					if (!committed) break;
+				}
+				if (committed) m_multi_partition_commits.fetch_add(1);
+			}
+		}
+		if (!committed) {
+			abort_transaction();
+			return false;
+		}
+		ts_transaction_changes.clear();
+		ts_transaction_reads.clear();
+		ts_transaction_read_only = false;
+		ts_transaction_active = false;
+		return true;
+	}
+
+	// aborts current uncommited changes
+	// returns false if no changes to abort, otherwise true
+	virtual bool abort_transaction() override {
+		if (!ts_transaction_active) return false;
+		ts_transaction_changes.clear();
+		ts_transaction_reads.clear();
+		ts_transaction_read_only = false;
+		ts_transaction_active = false;
+		return true;
+	}
+
+	// gets value given key: from uncommited changes, the transaction's read
+	// set, then the key's partition
+	// returns "" if nothing was found / transaction was not started
+	virtual std::string get_key(const std::string& key) override {
+		if (!ts_transaction_active) return "";
+		return lookup_key(HashedKey(key));
+	}
+
+	// adds new key-value pair (or modifies existing) to uncommited changes
+	// returns previous value at that key if it exists
+	// returns "" if it doesn't exist or transaction wasn't started / is
+	// read-only
+	virtual std::string set_key(const std::string& key,
+								const std::string& data) override {
+		if (!is_writable()) return "";
+		HashedKey hashed(key);
+		std::string old_value = lookup_key(hashed);
+		ts_transaction_changes[std::move(hashed)] = data;
+		return old_value;
+	}
+
+	// adds delete key query to uncommited changes
+	// returns previous value at that key if it exists
+	// returns "" if it doesn't exist or transaction wasn't started / is
+	// read-only
+	virtual std::string delete_key(const std::string& key) override {
+		if (!is_writable()) return "";
+		HashedKey hashed(key);
+		std::string old_value = lookup_key(hashed);
+		ts_transaction_changes[std::move(hashed)] = std::nullopt;
+		return old_value;
+	}
+
+	// set_key() without reading the previous value
+	// returns false if transaction wasn't started / is read-only
+	bool put_key(const std::string& key, const std::string& data) {
+		if (!is_writable()) return false;
+		ts_transaction_changes[HashedKey(key)] = data;
+		return true;
+	}
+
+	// delete_key() without reading the previous value
+	// returns false if transaction wasn't started / is read-only
+	bool erase_key(const std::string& key) {
+		if (!is_writable()) return false;
+		ts_transaction_changes[HashedKey(key)] = std::nullopt;
+		return true;
+	}
+
+	// gets committed value of a key, ignoring the transaction's own
+	// uncommited changes
+	// returns "" if nothing was found / transaction was not started
+	std::string get_committed_key(const std::string& key) {
+		if (!ts_transaction_active) return "";
+		return lookup_committed_key(HashedKey(key));
+	}
+
+	// CachedFileDatabase::scan() over all partitions: their committed pairs
+	// are merged in key order with values the transaction already read and
+	// its own changes. all partitions are read under their commit locks, so
+	// a scan sees whole commits only
+	// returns nothing if transaction was not started
+	std::vector<std::pair<std::string, std::string>> scan(
+		const std::string& start, const std::string& end, size_t limit = 0) {
+		std::vector<std::pair<std::string, std::string>> result;
+		if (!ts_transaction_active) return result;
+		// own deletes and keys read as absent can hide as many committed
+		// keys
+		size_t partition_limit =
+			limit ? limit + ts_transaction_changes.size() +
+						ts_transaction_reads.size()
+				  : 0;
+		std::map<std::string, std::string> merged;
+		{
+			// in partition order, as commits take them
+			std::vector<std::shared_lock<std::shared_mutex>> locks;
+			for (auto& partition : m_partitions) {
+				locks.emplace_back(partition->commit_mutex);
+			}
+			for (auto& partition : m_partitions) {
+				for (auto& pair : partition->db->scan_committed(
+						 start, end, partition_limit)) {
+					merged.insert(std::move(pair));
+				}
+			}
+		}
+		// values the transaction already read, then its own changes
+		for (const auto& [hashed, value] : ts_transaction_reads) {
+			const std::string& key = hashed.key;
+			if (key < start || (!end.empty() && key >= end)) continue;
+			if (!value.empty()) {
+				merged[key] = value;
+			} else {
+				merged.erase(key);
+			}
+		}
+		for (const auto& [hashed, value] : ts_transaction_changes) {
+			const std::string& key = hashed.key;
+			if (key < start || (!end.empty() && key >= end)) continue;
+			if (value) {
+				merged[key] = *value;
+			} else {
+				merged.erase(key);
+			}
+		}
+		for (auto& pair : merged) {
+			if (limit > 0 && result.size() >= limit) break;
+			result.emplace_back(pair.first, std::move(pair.second));
+		}
+		return result;
+	}
+
+	// scan() of all keys starting with `prefix`
+	std::vector<std::pair<std::string, std::string>> scan_prefix(
+		const std::string& prefix, size_t limit = 0) {
+		return scan(prefix, prefix_scan_end(prefix), limit);
+	}
+
+	// metrics of all partitions added up
+	MetricsSnapshot stats() {
+		MetricsSnapshot result;
+		for (auto& partition : m_partitions) {
+			result.add(partition->db->stats());
+		}
+		return result;
+	}
+
+	// commits that wrote to more than one partition
+	uint64_t multi_partition_commits() const {
+		return m_multi_partition_commits.load();
+	}
+};
@@ -0,0 +1,153 @@
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "db_cache.hpp"
+#include "partitioned_db.hpp"
+
+// Checks of PartitionedDatabase commits made while the thread is in a
+// transaction of a CachedFileDatabase (transaction state of all
+// CachedFileDatabase instances is shared per thread, partitions included):
+//   - the commit fails, single- or multi-partition, writes nothing to any
+//     partition and ends the PartitionedDatabase transaction
+//   - the outer transaction keeps only its own writes and still commits
+//   - once it has, the same commit goes through
+// It prints violations and exits with 1 if any check failed.
+
+struct PartitionTestConfig {
+	std::string db_file{"partitioned_test_db.txt"};
+	size_t partitions{4};
+	// keys written by the multi-partition commit
+	size_t keys{64};
+};
+
+std::map<std::string, std::string> contents(CachedFileDatabase& db) {
+	std::vector<std::pair<std::string, std::string>> records;
+	db.read_all(records);
+	return std::map<std::string, std::string>(records.begin(), records.end());
+}
+
+// contents of all partitions
+std::map<std::string, std::string> contents(PartitionedDatabase& db) {
+	std::map<std::string, std::string> result;
+	for (size_t i = 0; i < db.partition_count(); ++i) {
+		result.merge(contents(db.partition(i)));
+	}
+	return result;
+}
+
+std::string test_key(size_t key_number) {
+	return "p.k" + std::to_string(key_number);
+}
+
+// runs all checks, returns the violations found
+std::vector<std::string> run_checks(const PartitionTestConfig& config) {
+	std::vector<std::string> violations;
+	auto check = [&violations](bool ok, const std::string& what) {
+		if (!ok) violations.push_back(what);
+	};
+	for (size_t i = 0; i < config.partitions; ++i) {
+		std::remove(
+			PartitionedDatabase::partition_path(config.db_file, i).c_str());
+	}
+	std::string outer_file = config.db_file + ".outer";
+	std::ofstream(outer_file, std::ios::trunc);
+	PartitionedDatabase db(config.db_file, config.partitions);
+	CachedFileDatabase outer(outer_file);
+
+	// single partition, then keys of all of them
+	std::vector<std::vector<std::string>> commits{{test_key(0)}, {}};
+	for (size_t k = 0; k < config.keys; ++k) {
+		commits[1].push_back(test_key(k));
+	}
+	for (const auto& keys : commits) {
+		std::string name = std::to_string(keys.size()) + " key commit: ";
+		check(outer.begin_transaction(), name + "outer begin failed");
+		outer.put_key("outer", "1");
+		check(db.begin_transaction(), name + "begin failed");
+		for (const std::string& key : keys) db.put_key(key, "v");
+		check(!db.commit_transaction(),
+			  name + "commit in an outer transaction succeeded");
+		check(db.get_key(keys[0]).empty() && !db.abort_transaction(),
+			  name + "transaction still active after the failed commit");
+		check(outer.commit_transaction(), name + "outer commit failed");
+		check(contents(outer) ==
+				  std::map<std::string, std::string>{{"outer", "1"}},
+			  name + "outer transaction wrote more than its own writes");
+		check(contents(db).empty(),
+			  name + "failed commit wrote to partitions");
+
+		uint64_t multi_partition = db.multi_partition_commits();
+		check(db.begin_transaction(), name + "begin after failure failed");
+		for (const std::string& key : keys) db.put_key(key, "v");
+		check(db.commit_transaction(), name + "commit after failure failed");
+		check(db.multi_partition_commits() - multi_partition ==
+				  (keys.size() > 1 ? 1u : 0u),
+			  name + "keys of the commit not spread as expected");
+		check(contents(db).size() == keys.size(),
+			  name + "commit after failure didn't write all keys");
+		db.begin_transaction();
+		for (const std::string& key : keys) db.erase_key(key);
+		db.commit_transaction();
+	}
+	std::remove(outer_file.c_str());
+	return violations;
+}
+
+void print_usage(const char* program) {
+	std::cerr << "Usage: " << program << " [options]\r\n"
+			  << "  --db <file>               DB file, partitions are "
+				 "<file>.<i> (partitioned_test_db.txt)\r\n"
+			  << "  --partitions <n>          hash partitions (4)\r\n"
+			  << "  --keys <n>                keys of the multi-partition "
+				 "commit (64)\r\n";
+}
+
+// returns false on invalid arguments
+bool parse_args(int argc, char* argv[], PartitionTestConfig& config) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		std::string value = argv[++i];
+		if (arg == "--db") {
+			config.db_file = value;
+		} else if (arg == "--partitions") {
+			config.partitions = std::stoull(value);
+		} else if (arg == "--keys") {
+			config.keys = std::stoull(value);
+		} else {
+			return false;
+		}
+	}
+	return config.partitions > 1 && config.keys > 0;
+}
+
+int main(int argc, char* argv[]) {
+	PartitionTestConfig config;
+	try {
+		if (!parse_args(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Error: Invalid number as an argument!\r\n";
+		return 1;
+	}
+
+	std::vector<std::string> violations = run_checks(config);
+	for (const std::string& violation : violations) {
+		std::cout << "[VIOLATION] " << violation << "\r\n";
+	}
+	std::cout << config.partitions << " partitions, " << config.keys
+			  << " keys: "
+			  << (violations.empty()
+					  ? std::string("ok")
+					  : std::to_string(violations.size()) + " violations")
+			  << "\r\n";
+	return violations.empty() ? 0 : 1;
+}
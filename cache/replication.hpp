@@ -0,0 +1,614 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "db_cache.hpp"
+#include "metrics.hpp"
+
+// Log-shipping replication of a CachedFileDatabase to read replicas in
+// other processes of the host, over a Unix socket.
+// The primary (ReplicationPrimary) sends every replica that connects a full
+// copy of the DB, then the write set of every commit in commit order, and a
+// heartbeat with its last commit number when it has nothing else to send.
+// The replica (ReplicaClient) applies them to its own DB file and cache
+// and knows how fresh its data is: it is as fresh as the primary was at the
+// send time of the last frame it has caught up with. Both ends read the
+// same system clock, which is why replication is limited to one host.
+//
+// Frame: u8 type, u64 sequence, u64 send time (ns since epoch), u64 payload
+// size (little-endian), payload. Strings in payloads are varint length
+// prefixed.
+// - snapshot: DB contents as of commit `sequence`; varint record count,
+//   then key, value of each
+// - write set: changes of commit `sequence`; varint set count, key, value
+//   of each, varint delete count, key of each
+// - heartbeat: no payload, `sequence` is the primary's last commit
+namespace replication {
+
+enum class FrameType : uint8_t { snapshot = 1, write_set = 2, heartbeat = 3 };
+
+constexpr size_t kFrameHeaderSize = 1 + 3 * sizeof(uint64_t);
+
+inline uint64_t now_ns() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::system_clock::now().time_since_epoch())
+		.count();
+}
+
+inline void append_u64(std::string& out, uint64_t value) {
+	for (int i = 0; i < 8; ++i) {
+		out.push_back(static_cast<char>(value >> (8 * i)));
+	}
+}
+inline uint64_t parse_u64(const char* pos) {
+	uint64_t value{0};
+	for (int i = 0; i < 8; ++i) {
+		value |= static_cast<uint64_t>(static_cast<uint8_t>(pos[i])) << (8 * i);
+	}
+	return value;
+}
+
+inline void append_string(std::string& out, std::string_view value) {
+	varint_append(out, value.size());
+	out.append(value);
+}
+// returns false if the string is truncated
+inline bool parse_string(const char*& pos, const char* end,
+						 std::string& value) {
+	uint64_t size{};
+	if (!varint_parse(pos, end, size) ||
+		static_cast<uint64_t>(end - pos) < size) {
+		return false;
+	}
+	value.assign(pos, size);
+	pos += size;
+	return true;
+}
+
+// appends a frame of `type` with `payload` to `out`
+inline void append_frame(std::string& out, FrameType type, uint64_t sequence,
+						 uint64_t send_time_ns, std::string_view payload) {
+	out.push_back(static_cast<char>(type));
+	append_u64(out, sequence);
+	append_u64(out, send_time_ns);
+	append_u64(out, payload.size());
+	out.append(payload);
+}
+
+inline std::string encode_records(
+	const std::vector<std::pair<std::string, std::string>>& records) {
+	std::string payload;
+	varint_append(payload, records.size());
+	for (const auto& [key, value] : records) {
+		append_string(payload, key);
+		append_string(payload, value);
+	}
+	return payload;
+}
+// returns false if the payload is malformed
+inline bool decode_records(
+	const char*& pos, const char* end,
+	std::vector<std::pair<std::string, std::string>>& records) {
+	uint64_t count{};
+	if (!varint_parse(pos, end, count)) return false;
+	records.clear();
+	for (uint64_t i = 0; i < count; ++i) {
+		std::string key, value;
+		if (!parse_string(pos, end, key) || !parse_string(pos, end, value)) {
+			return false;
+		}
+		records.emplace_back(std::move(key), std::move(value));
+	}
+	return true;
+}
+
+inline std::string encode_write_set(const WriteSet& write_set) {
+	std::string payload = encode_records(write_set.sets);
+	varint_append(payload, write_set.deletes.size());
+	for (const std::string& key : write_set.deletes) {
+		append_string(payload, key);
+	}
+	return payload;
+}
+// returns false if the payload is malformed
+inline bool decode_write_set(const char* pos, const char* end,
+							 WriteSet& write_set) {
+	uint64_t count{};
+	if (!decode_records(pos, end, write_set.sets) ||
+		!varint_parse(pos, end, count)) {
+		return false;
+	}
+	write_set.deletes.clear();
+	for (uint64_t i = 0; i < count; ++i) {
+		std::string key;
+		if (!parse_string(pos, end, key)) return false;
+		write_set.deletes.push_back(std::move(key));
+	}
+	return pos == end;
+}
+
+// writes all of `data` to blocking socket `fd`. returns false on errors
+inline bool send_all(int fd, std::string_view data) {
+	while (!data.empty()) {
+		ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		data.remove_prefix(n);
+	}
+	return true;
+}
+
+// fills a Unix socket address for `path`. returns false if it's too long
+inline bool unix_address(const std::string& path, sockaddr_un& address) {
+	address = sockaddr_un{};
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Unix socket path is too long!\r\n";
+		return false;
+	}
+	address.sun_family = AF_UNIX;
+	std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+}  // namespace replication
+
+// Primary side of replication: serves replicas connecting to Unix socket
+// `path`. Write sets are encoded by the commit listener (under the DB file
+// lock, so in commit order) into per-replica output buffers, and a sender
+// thread per replica writes them out, so commits never wait for a socket.
+// A replica that falls more than kMaxBacklog bytes behind is disconnected,
+// it resyncs from a fresh snapshot when it reconnects.
+class ReplicationPrimary {
+   private:
+	static constexpr size_t kMaxBacklog = 64 * 1024 * 1024;
+	// how often the accept thread checks for stop and dead replicas
+	static constexpr int kPollMs = 200;
+
+	struct Replica {
+		int fd;
+		// frames not sent yet
+		std::string out;
+		// false until the snapshot is at the front of `out`
+		bool ready{false};
+		bool dead{false};
+		std::thread sender;
+	};
+
+	CachedFileDatabase& m_db;
+	std::string m_path;
+	int m_listen_fd;
+	std::chrono::milliseconds m_heartbeat;
+	// guards the replica list and their buffers. taken by the commit
+	// listener under the DB file lock, so never call the DB holding it
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::list<Replica> m_replicas;
+	bool m_stop{false};
+	std::thread m_accept_thread;
+
+	ReplicationPrimary(CachedFileDatabase& db, std::string path, int listen_fd,
+					   std::chrono::milliseconds heartbeat)
+		: m_db(db),
+		  m_path(std::move(path)),
+		  m_listen_fd(listen_fd),
+		  m_heartbeat(heartbeat) {}
+
+	// commit listener: queues the write set for every replica
+	void on_commit(const WriteSet& write_set) {
+		std::string frame;
+		replication::append_frame(frame, replication::FrameType::write_set,
+								  write_set.sequence, replication::now_ns(),
+								  replication::encode_write_set(write_set));
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (Replica& replica : m_replicas) {
+			if (replica.dead) continue;
+			if (replica.out.size() + frame.size() > kMaxBacklog) {
+				std::cerr << "Replication: replica fell too far behind, "
+							 "disconnecting it\r\n";
+				replica.dead = true;
+				// unblocks its sender if it's stuck in send()
+				::shutdown(replica.fd, SHUT_RDWR);
+				continue;
+			}
+			replica.out.append(frame);
+		}
+		m_cv.notify_all();
+	}
+
+	// sends queued frames of `replica` (heartbeats when there are none)
+	// until it disconnects or the primary stops
+	void send_loop(Replica& replica) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_stop && !replica.dead) {
+			if (!replica.ready || replica.out.empty()) {
+				bool woken = m_cv.wait_for(lock, m_heartbeat, [&] {
+					return m_stop || replica.dead ||
+						   (replica.ready && !replica.out.empty());
+				});
+				if (!woken && replica.ready) {
+					replication::append_frame(
+						replica.out, replication::FrameType::heartbeat,
+						m_db.commit_sequence(), replication::now_ns(), {});
+				}
+				continue;
+			}
+			std::string chunk;
+			chunk.swap(replica.out);
+			lock.unlock();
+			bool sent = replication::send_all(replica.fd, chunk);
+			lock.lock();
+			if (!sent) replica.dead = true;
+		}
+	}
+
+	// registers a connected replica and queues a DB snapshot in front of
+	// the write sets committed since it registered (the replica skips the
+	// ones the snapshot already has)
+	void add_replica(int fd) {
+		Replica* replica;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			replica = &m_replicas.emplace_back();
+			replica->fd = fd;
+			replica->sender =
+				std::thread([this, replica] { send_loop(*replica); });
+		}
+		std::vector<std::pair<std::string, std::string>> records;
+		uint64_t sequence = m_db.read_all(records);
+		std::string frame;
+		replication::append_frame(frame, replication::FrameType::snapshot,
+								  sequence, replication::now_ns(),
+								  replication::encode_records(records));
+		std::lock_guard<std::mutex> lock(m_mutex);
+		replica->out.insert(0, frame);
+		replica->ready = true;
+		m_cv.notify_all();
+	}
+
+	// joins senders of dead replicas and closes their sockets (all of them
+	// if `all`)
+	void reap(bool all) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (auto it = m_replicas.begin(); it != m_replicas.end();) {
+			if (!all && !it->dead) {
+				++it;
+				continue;
+			}
+			it->dead = true;
+			// unblocks its sender if it's stuck in send()
+			::shutdown(it->fd, SHUT_RDWR);
+			m_cv.notify_all();
+			lock.unlock();
+			it->sender.join();
+			lock.lock();
+			::close(it->fd);
+			it = m_replicas.erase(it);
+		}
+	}
+
+	void accept_loop() {
+		while (true) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_stop) break;
+			}
+			pollfd listener{m_listen_fd, POLLIN, 0};
+			if (::poll(&listener, 1, kPollMs) > 0) {
+				int fd = ::accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+				if (fd >= 0) add_replica(fd);
+			}
+			reap(false);
+		}
+		reap(true);
+	}
+
+   public:
+	// Starts serving replicas of `db` on Unix socket `path` (replacing a
+	// stale one), sending heartbeats every `heartbeat` while idle. Replicas
+	// can't tell how fresh they are more precisely than that.
+	// returns nullptr (after printing why) on errors
+	static std::unique_ptr<ReplicationPrimary> start(
+		CachedFileDatabase& db, const std::string& path,
+		std::chrono::milliseconds heartbeat = std::chrono::milliseconds(100)) {
+		sockaddr_un address;
+		if (!replication::unix_address(path, address)) return nullptr;
+		::unlink(path.c_str());
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0 ||
+			::bind(fd, reinterpret_cast<sockaddr*>(&address),
+				   sizeof(address)) != 0 ||
+			::listen(fd, SOMAXCONN) != 0) {
+			std::cerr << "Error listening for replicas on " << path << ": "
+					  << std::strerror(errno) << "\r\n";
+			if (fd >= 0) ::close(fd);
+			return nullptr;
+		}
+		std::unique_ptr<ReplicationPrimary> primary(
+			new ReplicationPrimary(db, path, fd, heartbeat));
+		ReplicationPrimary* self = primary.get();
+		db.set_commit_listener(
+			[self](const WriteSet& write_set) { self->on_commit(write_set); });
+		primary->m_accept_thread = std::thread([self] { self->accept_loop(); });
+		return primary;
+	}
+
+	ReplicationPrimary(const ReplicationPrimary&) = delete;
+	ReplicationPrimary& operator=(const ReplicationPrimary&) = delete;
+	~ReplicationPrimary() {
+		m_db.set_commit_listener(nullptr);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cv.notify_all();
+		m_accept_thread.join();
+		::close(m_listen_fd);
+		::unlink(m_path.c_str());
+	}
+
+	// number of connected replicas
+	size_t replicas() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return std::count_if(m_replicas.begin(), m_replicas.end(),
+							 [](const Replica& r) { return !r.dead; });
+	}
+};
+
+// Point in time view of a replica's replication state
+struct ReplicationStats {
+	bool connected{false};
+	// last commit of the primary applied here / known to exist
+	uint64_t applied_sequence{0};
+	uint64_t primary_sequence{0};
+	// how old the replica's data may be, UINT64_MAX before the first sync
+	uint64_t staleness_ns{0};
+	uint64_t connects{0};
+	uint64_t snapshots{0};
+	uint64_t write_sets{0};
+	// time from a commit on the primary to it being applied here
+	HistogramSnapshot apply_lag;
+
+	std::string to_json() const {
+		std::ostringstream out;
+		out << "{\"connected\": " << (connected ? "true" : "false")
+			<< ", \"applied_sequence\": " << applied_sequence
+			<< ", \"primary_sequence\": " << primary_sequence
+			<< ", \"lag_commits\": "
+			<< (primary_sequence > applied_sequence
+					? primary_sequence - applied_sequence
+					: 0)
+			<< ", \"staleness_ns\": " << staleness_ns
+			<< ", \"connects\": " << connects
+			<< ", \"snapshots\": " << snapshots
+			<< ", \"write_sets\": " << write_sets
+			<< ", \"apply_lag_ns\": " << apply_lag.to_json() << "}";
+		return out.str();
+	}
+};
+
+// Replica side of replication: keeps `db` in sync with the primary serving
+// Unix socket `path` from a background thread, reconnecting (and resyncing
+// from a snapshot) whenever the connection drops. `db` should only be read
+// by everyone else, read transactions can require bounded staleness with
+// begin_read_transaction().
+class ReplicaClient {
+   private:
+	// how long to wait before reconnecting / how often to check for stop
+	static constexpr int kRetryMs = 100;
+	static constexpr int kPollMs = 200;
+	static constexpr size_t kReadChunk = 64 * 1024;
+	static constexpr uint64_t kNeverSynced =
+		std::numeric_limits<uint64_t>::max();
+
+	CachedFileDatabase& m_db;
+	std::string m_path;
+	std::atomic<bool> m_stop{false};
+	std::atomic<bool> m_connected{false};
+	// last commit of the primary we heard of
+	std::atomic<uint64_t> m_primary_sequence{0};
+	// primary send time of the last frame whose sequence is applied here,
+	// kNeverSynced until the first snapshot is
+	std::atomic<uint64_t> m_fresh_as_of_ns{kNeverSynced};
+	// written by the replication thread only (counter_add)
+	std::atomic<uint64_t> m_connects{0};
+	std::atomic<uint64_t> m_snapshots{0};
+	std::atomic<uint64_t> m_write_sets{0};
+	LatencyHistogram m_apply_lag;
+	std::thread m_thread;
+
+	// returns connected socket, -1 if the primary isn't there
+	int connect_primary() {
+		sockaddr_un address;
+		if (!replication::unix_address(m_path, address)) return -1;
+		int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&address),
+								 sizeof(address)) == 0) {
+			return fd;
+		}
+		if (fd >= 0) ::close(fd);
+		return -1;
+	}
+
+	// marks the replica as fresh as of `send_time_ns` if it has applied
+	// everything the primary had at that time
+	void caught_up(uint64_t sequence, uint64_t send_time_ns) {
+		if (m_db.commit_sequence() < sequence) return;
+		uint64_t fresh = m_fresh_as_of_ns.load();
+		if (fresh == kNeverSynced || fresh < send_time_ns) {
+			m_fresh_as_of_ns.store(send_time_ns);
+		}
+	}
+
+	// applies one frame. returns false if it is malformed or can't be
+	// written to the DB
+	bool apply_frame(replication::FrameType type, uint64_t sequence,
+					 uint64_t send_time_ns, const char* payload, size_t size) {
+		const char* end = payload + size;
+		if (sequence > m_primary_sequence.load()) {
+			m_primary_sequence.store(sequence);
+		}
+		switch (type) {
+			case replication::FrameType::snapshot: {
+				std::vector<std::pair<std::string, std::string>> records;
+				if (!replication::decode_records(payload, end, records) ||
+					payload != end) {
+					return false;
+				}
+				if (!m_db.replace_all(records, sequence)) return false;
+				// the primary may have restarted with lower numbers
+				m_primary_sequence.store(sequence);
+				counter_add(m_snapshots);
+				break;
+			}
+			case replication::FrameType::write_set: {
+				// the snapshot may already have it
+				if (sequence <= m_db.commit_sequence()) break;
+				WriteSet write_set;
+				if (!replication::decode_write_set(payload, end, write_set)) {
+					return false;
+				}
+				write_set.sequence = sequence;
+				if (!m_db.apply_write_set(write_set)) return false;
+				counter_add(m_write_sets);
+				uint64_t now = replication::now_ns();
+				m_apply_lag.record(now > send_time_ns ? now - send_time_ns : 0);
+				break;
+			}
+			case replication::FrameType::heartbeat:
+				break;
+			default:
+				return false;
+		}
+		caught_up(sequence, send_time_ns);
+		return true;
+	}
+
+	// applies frames from `fd` until it closes or the replica stops
+	void receive_loop(int fd) {
+		std::string in;
+		while (!m_stop.load()) {
+			pollfd primary{fd, POLLIN, 0};
+			int ready = ::poll(&primary, 1, kPollMs);
+			if (ready == 0) continue;
+			if (ready < 0 && errno == EINTR) continue;
+			if (ready < 0) return;
+			size_t size = in.size();
+			in.resize(size + kReadChunk);
+			ssize_t n = ::read(fd, in.data() + size, kReadChunk);
+			in.resize(size + std::max<ssize_t>(n, 0));
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return;
+
+			size_t pos{0};
+			while (in.size() - pos >= replication::kFrameHeaderSize) {
+				const char* header = in.data() + pos;
+				uint64_t payload_size = replication::parse_u64(header + 17);
+				if (in.size() - pos - replication::kFrameHeaderSize <
+					payload_size) {
+					break;
+				}
+				if (!apply_frame(static_cast<replication::FrameType>(header[0]),
+								 replication::parse_u64(header + 1),
+								 replication::parse_u64(header + 9),
+								 header + replication::kFrameHeaderSize,
+								 payload_size)) {
+					std::cerr << "Replication: malformed frame from the "
+								 "primary or DB write failed, "
+								 "reconnecting\r\n";
+					return;
+				}
+				pos += replication::kFrameHeaderSize + payload_size;
+			}
+			in.erase(0, pos);
+		}
+	}
+
+	void run() {
+		while (!m_stop.load()) {
+			int fd = connect_primary();
+			if (fd < 0) {
+				std::this_thread::sleep_for(
+					std::chrono::milliseconds(kRetryMs));
+				continue;
+			}
+			counter_add(m_connects);
+			m_connected.store(true);
+			receive_loop(fd);
+			m_connected.store(false);
+			::close(fd);
+		}
+	}
+
+   public:
+	ReplicaClient(CachedFileDatabase& db, std::string path)
+		: m_db(db), m_path(std::move(path)), m_thread([this] { run(); }) {}
+	ReplicaClient(const ReplicaClient&) = delete;
+	ReplicaClient& operator=(const ReplicaClient&) = delete;
+	~ReplicaClient() { stop(); }
+
+	// stops replicating, the DB keeps what was applied so far
+	void stop() {
+		m_stop.store(true);
+		if (m_thread.joinable()) m_thread.join();
+	}
+
+	// how old the replica's data may be: time since the primary last sent
+	// something the replica has caught up with. nanoseconds::max() before
+	// the first sync
+	std::chrono::nanoseconds staleness() const {
+		uint64_t fresh = m_fresh_as_of_ns.load();
+		if (fresh == kNeverSynced) return std::chrono::nanoseconds::max();
+		uint64_t now = replication::now_ns();
+		return std::chrono::nanoseconds(now > fresh ? now - fresh : 0);
+	}
+
+	// begins a read-only transaction on the replica's DB if its data is at
+	// most `max_staleness` old. commit (a no-op, nothing is written) or
+	// abort it as usual
+	// returns false if the replica is too stale or the thread already is in
+	// a transaction
+	bool begin_read_transaction(std::chrono::nanoseconds max_staleness) {
+		if (staleness() > max_staleness) return false;
+		return m_db.begin_read_only();
+	}
+
+	ReplicationStats stats() const {
+		ReplicationStats result;
+		result.connected = m_connected.load();
+		result.applied_sequence = m_db.commit_sequence();
+		result.primary_sequence = m_primary_sequence.load();
+		auto staleness_ns = staleness().count();
+		result.staleness_ns =
+			staleness_ns == std::chrono::nanoseconds::max().count()
+				? kNeverSynced
+				: static_cast<uint64_t>(staleness_ns);
+		result.connects = m_connects.load(std::memory_order_relaxed);
+		result.snapshots = m_snapshots.load(std::memory_order_relaxed);
+		result.write_sets = m_write_sets.load(std::memory_order_relaxed);
+		m_apply_lag.merge_into(result.apply_lag);
+		return result;
+	}
+};
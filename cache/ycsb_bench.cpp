@@ -0,0 +1,490 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "db_cache.hpp"
+#include "partitioned_db.hpp"
+
+// YCSB-style workload benchmark for CachedFileDatabase.
+// Loads `records` keys, then runs a mix of read/update/insert/scan/
+// read-modify-write operations from several threads, grouped into
+// transactions of `txn_size` operations, and reports throughput and
+// latency percentiles per operation type.
+
+enum class Distribution { uniform, zipfian, latest };
+
+struct WorkloadConfig {
+	std::string db_file{"ycsb_db.txt"};
+	DbFormat format{DbFormat::text};
+	int cache_size{1000};
+	bool near_cache{false};
+	// cached values at least this long are compressed, 0 - off
+	size_t compress_min_size{0};
+	// size of the disk cache tier (file next to the DB), 0 - none
+	uint64_t disk_cache_mb{0};
+	// hash partitions of the DB (PartitionedDatabase), 1 - one DB file
+	size_t partitions{1};
+	size_t records{1000};
+	size_t operations{10000};
+	int threads{4};
+	size_t value_size{100};
+	size_t txn_size{1};
+	size_t max_scan_length{100};
+	double read{0.5}, update{0.5}, insert{0}, scan{0}, rmw{0};
+	Distribution distribution{Distribution::zipfian};
+};
+
+// sets operation mix and key distribution of standard YCSB workloads A-F
+// returns false for an unknown workload
+bool apply_workload(char workload, WorkloadConfig& config) {
+	config.read = config.update = config.insert = config.scan = config.rmw = 0;
+	config.distribution = Distribution::zipfian;
+	switch (workload) {
+		case 'a':  // update heavy
+			config.read = 0.5;
+			config.update = 0.5;
+			break;
+		case 'b':  // read mostly
+			config.read = 0.95;
+			config.update = 0.05;
+			break;
+		case 'c':  // read only
+			config.read = 1;
+			break;
+		case 'd':  // read latest
+			config.read = 0.95;
+			config.insert = 0.05;
+			config.distribution = Distribution::latest;
+			break;
+		case 'e':  // short ranges
+			config.scan = 0.95;
+			config.insert = 0.05;
+			break;
+		case 'f':  // read-modify-write
+			config.read = 0.5;
+			config.rmw = 0.5;
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+// FNV-1a 64 bit, scatters sequential key numbers like YCSB does
+uint64_t fnv_hash64(uint64_t value) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (int i = 0; i < 8; ++i) {
+		hash ^= value & 0xFF;
+		hash *= 0x100000001B3ULL;
+		value >>= 8;
+	}
+	return hash;
+}
+
+std::string key_name(uint64_t key_number) {
+	return "user" + std::to_string(fnv_hash64(key_number));
+}
+
+// Zipfian distributed numbers in [0, n) (Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases"), same as YCSB's ZipfianGenerator.
+// Item 0 is the most popular; n can grow (inserts) with zeta updated
+// incrementally.
+class ZipfianGenerator {
+   private:
+	static constexpr double kTheta = 0.99;
+	uint64_t m_items{0};
+	double m_zeta_n{0};
+	double m_zeta_2;
+	double m_alpha;
+	double m_eta{0};
+
+	void grow_to(uint64_t items) {
+		for (uint64_t i = m_items; i < items; ++i) {
+			m_zeta_n += 1.0 / std::pow(static_cast<double>(i + 1), kTheta);
+		}
+		m_items = items;
+		m_eta = (1 - std::pow(2.0 / m_items, 1 - kTheta)) /
+				(1 - m_zeta_2 / m_zeta_n);
+	}
+
+   public:
+	ZipfianGenerator(uint64_t items)
+		: m_zeta_2(1 + 1 / std::pow(2.0, kTheta)), m_alpha(1 / (1 - kTheta)) {
+		grow_to(std::max<uint64_t>(items, 2));
+	}
+
+	uint64_t next(std::mt19937_64& rng, uint64_t items) {
+		if (items > m_items) grow_to(items);
+		double u = std::uniform_real_distribution<double>(0, 1)(rng);
+		double uz = u * m_zeta_n;
+		if (uz < 1) return 0;
+		if (uz < m_zeta_2) return 1;
+		return static_cast<uint64_t>(
+			m_items * std::pow(m_eta * u - m_eta + 1, m_alpha));
+	}
+};
+
+// picks key numbers among `items` inserted keys per configured distribution
+class KeyChooser {
+   private:
+	Distribution m_distribution;
+	ZipfianGenerator m_zipfian;
+
+   public:
+	KeyChooser(Distribution distribution, uint64_t items)
+		: m_distribution(distribution), m_zipfian(items) {}
+
+	uint64_t next(std::mt19937_64& rng, uint64_t items) {
+		switch (m_distribution) {
+			case Distribution::uniform: {
+				std::uniform_int_distribution<uint64_t> uniform(0, items - 1);
+				return uniform(rng);
+			}
+			case Distribution::latest:
+				// most recently inserted keys are the most popular
+				return items - 1 - m_zipfian.next(rng, items) % items;
+			case Distribution::zipfian:
+			default:
+				// scrambled, so popular keys are spread over the key space
+				return fnv_hash64(m_zipfian.next(rng, items)) % items;
+		}
+	}
+};
+
+enum Operation { kRead, kUpdate, kInsert, kScan, kRmw, kCommit, kOpCount };
+const char* const kOperationNames[kOpCount] = {"READ", "UPDATE", "INSERT",
+											   "SCAN", "RMW",	 "COMMIT"};
+
+// per-thread latency samples (nanoseconds) by operation type
+struct ThreadResult {
+	std::vector<uint64_t> latencies[kOpCount];
+};
+
+std::string random_value(std::mt19937_64& rng, size_t size) {
+	std::string value(size, ' ');
+	for (char& c : value) {
+		c = static_cast<char>('a' + rng() % 26);
+	}
+	return value;
+}
+
+template <typename Db>
+void run_thread(int thread_id, const WorkloadConfig& config, Db& db,
+				std::atomic<uint64_t>& key_count, size_t operations,
+				ThreadResult& result) {
+	std::mt19937_64 rng(0x5EED + thread_id);
+	KeyChooser chooser(config.distribution, key_count.load());
+	std::discrete_distribution<int> op_choice(
+		{config.read, config.update, config.insert, config.scan, config.rmw});
+	std::string value = random_value(rng, config.value_size);
+
+	auto now = [] { return std::chrono::steady_clock::now(); };
+	auto elapsed_ns = [](auto start, auto end) {
+		return static_cast<uint64_t>(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+				.count());
+	};
+
+	// read-only mixes (workload C) skip write-set bookkeeping
+	bool read_only = config.update == 0 && config.insert == 0 &&
+					 config.rmw == 0;
+	size_t done{0};
+	while (done < operations) {
+		if (read_only) {
+			db.begin_read_only();
+		} else {
+			db.begin_transaction();
+		}
+		for (size_t i = 0; i < config.txn_size && done < operations;
+			 ++i, ++done) {
+			int op = op_choice(rng);
+			// keys being inserted by other threads may not be committed
+			// yet, that only turns some reads into misses
+			uint64_t items = key_count.load(std::memory_order_relaxed);
+			// changing one character keeps writes from being no-ops
+			value[done % value.size()] = static_cast<char>('a' + rng() % 26);
+			auto start = now();
+			switch (op) {
+				case kRead:
+					db.get_key(key_name(chooser.next(rng, items)));
+					break;
+				// blind writes, YCSB updates and inserts don't read
+				case kUpdate:
+					db.put_key(key_name(chooser.next(rng, items)), value);
+					break;
+				case kInsert:
+					db.put_key(key_name(key_count.fetch_add(1)), value);
+					break;
+				case kScan:
+					// ordered scan from a chosen key, as in YCSB
+					db.scan(key_name(chooser.next(rng, items)), "",
+							1 + rng() % config.max_scan_length);
+					break;
+				case kRmw: {
+					std::string key = key_name(chooser.next(rng, items));
+					std::string old_value = db.get_key(key);
+					db.put_key(key, value);
+					break;
+				}
+			}
+			result.latencies[op].push_back(elapsed_ns(start, now()));
+		}
+		auto start = now();
+		db.commit_transaction();
+		result.latencies[kCommit].push_back(elapsed_ns(start, now()));
+	}
+}
+
+// percentile of sorted samples (nearest rank)
+uint64_t percentile(const std::vector<uint64_t>& sorted, double p) {
+	if (sorted.empty()) return 0;
+	size_t rank = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+	return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+void print_usage(const char* program) {
+	std::cerr
+		<< "Usage: " << program << " [options]\r\n"
+		<< "  --workload a|b|c|d|e|f    YCSB core workload (default a)\r\n"
+		<< "  --read/--update/--insert/--scan/--rmw <proportion>\r\n"
+		<< "                            override workload operation mix\r\n"
+		<< "  --distribution zipfian|uniform|latest\r\n"
+		<< "  --records <n>             keys loaded before the run (1000)\r\n"
+		<< "  --operations <n>          operations in total (10000)\r\n"
+		<< "  --threads <n>             client threads (4)\r\n"
+		<< "  --value-size <n>          value size in bytes (100)\r\n"
+		<< "  --txn-size <n>            operations per transaction (1)\r\n"
+		<< "  --scan-length <n>         max keys per scan (100)\r\n"
+		<< "  --cache-size <n>          cache capacity, 0 - no cache (1000)\r\n"
+		<< "  --near-cache 0|1          per-thread near cache (0)\r\n"
+		<< "  --compress <n>            compress cached values of n+ bytes, "
+		   "0 - off (0)\r\n"
+		<< "  --disk-cache-mb <n>       disk cache tier size, 0 - none (0)\r\n"
+		<< "  --db <file>               DB file, recreated (ycsb_db.txt)\r\n"
+		<< "  --partitions <n>          hash partitions, DB files <file>.<i> "
+		   "(1)\r\n"
+		<< "  --format text|binary      DB file format (text)\r\n";
+}
+
+// returns false on invalid arguments
+bool parse_args(int argc, char* argv[], WorkloadConfig& config) {
+	apply_workload('a', config);
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) return false;
+		std::string value = argv[++i];
+		if (arg == "--workload") {
+			if (value.size() != 1 ||
+				!apply_workload(std::tolower(value[0]), config)) {
+				return false;
+			}
+		} else if (arg == "--distribution") {
+			if (value == "zipfian") {
+				config.distribution = Distribution::zipfian;
+			} else if (value == "uniform") {
+				config.distribution = Distribution::uniform;
+			} else if (value == "latest") {
+				config.distribution = Distribution::latest;
+			} else {
+				return false;
+			}
+		} else if (arg == "--format") {
+			if (value != "text" && value != "binary") return false;
+			config.format =
+				value == "binary" ? DbFormat::binary : DbFormat::text;
+		} else if (arg == "--db") {
+			config.db_file = value;
+		} else if (arg == "--read") {
+			config.read = std::stod(value);
+		} else if (arg == "--update") {
+			config.update = std::stod(value);
+		} else if (arg == "--insert") {
+			config.insert = std::stod(value);
+		} else if (arg == "--scan") {
+			config.scan = std::stod(value);
+		} else if (arg == "--rmw") {
+			config.rmw = std::stod(value);
+		} else if (arg == "--records") {
+			config.records = std::stoull(value);
+		} else if (arg == "--operations") {
+			config.operations = std::stoull(value);
+		} else if (arg == "--threads") {
+			config.threads = std::stoi(value);
+		} else if (arg == "--value-size") {
+			config.value_size = std::stoull(value);
+		} else if (arg == "--txn-size") {
+			config.txn_size = std::stoull(value);
+		} else if (arg == "--scan-length") {
+			config.max_scan_length = std::stoull(value);
+		} else if (arg == "--cache-size") {
+			config.cache_size = std::stoi(value);
+		} else if (arg == "--near-cache") {
+			config.near_cache = std::stoi(value) != 0;
+		} else if (arg == "--compress") {
+			config.compress_min_size = std::stoull(value);
+		} else if (arg == "--disk-cache-mb") {
+			config.disk_cache_mb = std::stoull(value);
+		} else if (arg == "--partitions") {
+			config.partitions = std::stoull(value);
+		} else {
+			return false;
+		}
+	}
+	return config.records > 0 && config.threads > 0 && config.partitions > 0 &&
+		   config.value_size > 0 && config.txn_size > 0 &&
+		   config.max_scan_length > 0 &&
+		   config.read + config.update + config.insert + config.scan +
+				   config.rmw >
+			   0;
+}
+
+// per-DB options of `config`, `file` is the DB file of `db`
+void configure(CachedFileDatabase& db, const std::string& file,
+			   const WorkloadConfig& config) {
+	db.enable_near_cache(config.near_cache);
+	if (config.compress_min_size) {
+		db.enable_cache_compression(config.compress_min_size);
+	}
+	if (config.disk_cache_mb) {
+		db.enable_disk_cache(file + ".disk_cache",
+							 config.disk_cache_mb * 1024 * 1024);
+	}
+}
+
+// loads records into `db`, runs the workload and prints the results
+template <typename Db>
+void run_benchmark(Db& db, const WorkloadConfig& config) {
+	// load phase, not measured
+	auto load_start = std::chrono::steady_clock::now();
+	std::mt19937_64 load_rng(0x10AD);
+	std::string value = random_value(load_rng, config.value_size);
+	constexpr size_t kLoadBatch = 1000;
+	for (size_t i = 0; i < config.records; i += kLoadBatch) {
+		db.begin_transaction();
+		for (size_t k = i; k < std::min(i + kLoadBatch, config.records); ++k) {
+			db.put_key(key_name(k), value);
+		}
+		db.commit_transaction();
+	}
+	std::chrono::duration<double> load_time =
+		std::chrono::steady_clock::now() - load_start;
+	std::cout << "Loaded " << config.records << " records in "
+			  << load_time.count() << " s\r\n";
+
+	// run phase
+	std::atomic<uint64_t> key_count{config.records};
+	std::vector<ThreadResult> results(config.threads);
+	std::vector<std::thread> threads;
+	auto run_start = std::chrono::steady_clock::now();
+	for (int i = 0; i < config.threads; ++i) {
+		size_t operations = config.operations / config.threads +
+							(static_cast<size_t>(i) <
+							 config.operations % config.threads);
+		threads.emplace_back(run_thread<Db>, i, std::cref(config), std::ref(db),
+							 std::ref(key_count), operations,
+							 std::ref(results[i]));
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	std::chrono::duration<double> run_time =
+		std::chrono::steady_clock::now() - run_start;
+
+	const char* distribution_names[] = {"uniform", "zipfian", "latest"};
+	std::cout << "read " << config.read << ", update " << config.update
+			  << ", insert " << config.insert << ", scan " << config.scan
+			  << ", rmw " << config.rmw << ", "
+			  << distribution_names[static_cast<int>(config.distribution)]
+			  << " keys, " << config.threads << " threads, txn size "
+			  << config.txn_size << ", value size " << config.value_size
+			  << ", cache size " << config.cache_size << "\r\n";
+	std::cout << "[OVERALL] " << config.operations << " operations in "
+			  << run_time.count() << " s, throughput " << std::fixed
+			  << std::setprecision(1) << config.operations / run_time.count()
+			  << " ops/sec\r\n";
+	for (int op = 0; op < kOpCount; ++op) {
+		std::vector<uint64_t> samples;
+		for (const auto& result : results) {
+			samples.insert(samples.end(), result.latencies[op].begin(),
+						   result.latencies[op].end());
+		}
+		if (samples.empty()) continue;
+		std::sort(samples.begin(), samples.end());
+		std::cout << "[" << kOperationNames[op] << "] count "
+				  << samples.size() << ", p50 "
+				  << percentile(samples, 50) / 1000.0 << " us, p99 "
+				  << percentile(samples, 99) / 1000.0 << " us, p99.9 "
+				  << percentile(samples, 99.9) / 1000.0 << " us, max "
+				  << samples.back() / 1000.0 << " us\r\n";
+	}
+	MetricsSnapshot stats = db.stats();
+	std::cout << "[CACHE] hit ratio " << stats.cache_hit_ratio()
+			  << ", near cache hits " << stats.near_cache_hits
+			  << ", evictions " << stats.cache_evictions
+			  << ", bloom filter negatives " << stats.bloom_negatives
+			  << ", disk tier hits " << stats.second_tier_hits << "\r\n";
+	if (config.compress_min_size) {
+		const CacheCompressionStats& compression = stats.cache_compression;
+		std::cout << "[COMPRESSION] ratio " << compression.ratio()
+				  << ", compressed values " << compression.compressed_values
+				  << ", compress " << compression.compress_ns / 1e6
+				  << " ms in " << compression.compressions
+				  << ", decompress " << compression.decompress_ns / 1e6
+				  << " ms in " << compression.decompressions << "\r\n";
+	}
+}
+
+int main(int argc, char* argv[]) {
+	WorkloadConfig config;
+	try {
+		if (!parse_args(argc, argv, config)) {
+			print_usage(argv[0]);
+			return 1;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "Error: Invalid number as an argument!\r\n";
+		return 1;
+	}
+
+	// fresh DB files for every run
+	for (size_t i = 0; i < config.partitions; ++i) {
+		std::ofstream fout(
+			config.partitions > 1
+				? PartitionedDatabase::partition_path(config.db_file, i)
+				: config.db_file,
+			std::ios::trunc);
+		if (!fout) {
+			std::cerr << "Error opening file for writing!\r\n";
+			return 1;
+		}
+	}
+	if (config.partitions > 1) {
+		PartitionedDatabase db(config.db_file, config.partitions,
+							   config.cache_size, config.format);
+		for (size_t i = 0; i < db.partition_count(); ++i) {
+			configure(db.partition(i),
+					  PartitionedDatabase::partition_path(config.db_file, i),
+					  config);
+		}
+		run_benchmark(db, config);
+		std::cout << "[PARTITIONS] " << db.partition_count()
+				  << ", multi-partition commits "
+				  << db.multi_partition_commits() << "\r\n";
+	} else {
+		CachedFileDatabase db(config.db_file, config.cache_size, config.format);
+		configure(db, config.db_file, config);
+		run_benchmark(db, config);
+	}
+	print_lock_report(std::cout);
+	return 0;
+}